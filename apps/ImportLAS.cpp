@@ -3,7 +3,6 @@
 #include <vector>
 #include <limits>
 #include <lasreader.hpp>
-#include "../ColorMask.h"
 #include "ospray/common/OSPCommon.h"
 #include "ParticleModel.h"
 
@@ -90,12 +89,15 @@ namespace ospray {
 				else {
 					c = vec3f(1.0);
 				}
-				uint32_t col_masked = 0;
-				SET_RED(col_masked, static_cast<int>(c.x * 255));
-				SET_GREEN(col_masked, static_cast<int>(c.y * 255));
-				SET_BLUE(col_masked, static_cast<int>(c.z * 255));
+				// RGBA8, r in the lowest byte
+				const uint32_t rgba8 = static_cast<uint32_t>(c.x * 255)
+					| (static_cast<uint32_t>(c.y * 255) << 8)
+					| (static_cast<uint32_t>(c.z * 255) << 16)
+					| (255u << 24);
 				model->position.push_back(p);
-				model->addAttribute("color", *reinterpret_cast<float*>(&col_masked));
+				model->color.push_back(rgba8);
+				// the classification stays available for attribute culling
+				model->addAttribute("classification", reader->point.get_classification());
 			}
 			std::cout << "Discarded " << num_noise << " noise classified points\n";
 			reader->close();
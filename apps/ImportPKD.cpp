@@ -0,0 +1,132 @@
+// ======================================================================== //
+// Copyright 2009-2014 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "ospray/common/OSPCommon.h"
+#include "apps/common/xml/XML.h"
+#include "ParticleModel.h"
+// std
+#include <algorithm>
+#include <sstream>
+
+/*! \file ImportPKD.cpp reads the (non-quantized) output of ospPartiKD
+    back in, so an existing .pkd file can get re-built - e.g., over
+    only a subset of its particles */
+
+namespace ospray {
+  namespace pkd {
+    using std::cout;
+    using std::endl;
+
+    //! read 'count' items of type T at 'ofs' in the .pkdbin file
+    template<typename T>
+    void readArray(FILE *bin, size_t ofs, size_t count, std::vector<T> &out)
+    {
+      out.resize(count);
+      fseek(bin,ofs,SEEK_SET);
+      if (count && fread(&out[0],sizeof(T),count,bin) != count)
+        throw std::runtime_error("could not read pkd binary data");
+    }
+
+    void importGeometry(ParticleModel *model, const xml::Node *geom, FILE *bin)
+    {
+      const size_t begin = model->position.size();
+      std::vector<uint32> category;
+      std::vector<float>  categoryRadius;
+      std::vector<vec3f>  categoryColor;
+      std::vector<uint64> permutation;
+      for (size_t i=0;i<geom->child.size();i++) {
+        const xml::Node *child = geom->child[i];
+        if (child->name == "position") {
+          if (child->getProp("format") != "vec3f" && child->getProp("format") != "float3")
+            throw std::runtime_error("can only re-import non-quantized .pkd files");
+          std::vector<vec3f> position;
+          readArray(bin,child->getPropl("ofs"),child->getPropl("count"),position);
+          model->position.insert(model->position.end(),position.begin(),position.end());
+        } else if (child->name == "attribute") {
+          std::vector<float> value;
+          readArray(bin,child->getPropl("ofs"),child->getPropl("count"),value);
+          for (size_t j=0;j<value.size();j++)
+            model->addAttribute(child->getProp("name"),value[j]);
+        } else if (child->name == "color") {
+          std::vector<uint32> color;
+          readArray(bin,child->getPropl("ofs"),child->getPropl("count"),color);
+          model->color.insert(model->color.end(),color.begin(),color.end());
+        } else if (child->name == "category") {
+          if (child->getProp("format") == "uint16") {
+            std::vector<uint16> c;
+            readArray(bin,child->getPropl("ofs"),child->getPropl("count"),c);
+            category.assign(c.begin(),c.end());
+          } else {
+            std::vector<uint8> c;
+            readArray(bin,child->getPropl("ofs"),child->getPropl("count"),c);
+            category.assign(c.begin(),c.end());
+          }
+        } else if (child->name == "categoryColor") {
+          readArray(bin,child->getPropl("ofs"),child->getPropl("count"),categoryColor);
+        } else if (child->name == "categoryRadius") {
+          readArray(bin,child->getPropl("ofs"),child->getPropl("count"),categoryRadius);
+        } else if (child->name == "permutation") {
+          readArray(bin,child->getPropl("ofs"),child->getPropl("count"),permutation);
+        } else if (child->name == "radius") {
+          model->radius = atof(child->content.c_str());
+        }
+      }
+      cout << "#osp:pkd: read " << (model->position.size()-begin) << " particles" << endl;
+
+      // keep the index into the original input, so a re-build still
+      // maps onto the attributes of that input's timesteps
+      if (!permutation.empty()) {
+        for (size_t i=model->inputIndex.size();i<begin;i++)
+          model->inputIndex.push_back(i);
+        model->inputIndex.insert(model->inputIndex.end(),permutation.begin(),permutation.end());
+      }
+
+      // categories become particle types again, with their color and radius
+      if (category.empty())
+        return;
+      const size_t numTypes
+        = std::max((size_t)*std::max_element(category.begin(),category.end())+1,
+                   std::max(categoryColor.size(),categoryRadius.size()));
+      std::vector<uint32> typeID(numTypes);
+      for (size_t c=0;c<numTypes;c++) {
+        std::stringstream name;
+        name << "category" << c;
+        typeID[c] = model->getAtomTypeID(name.str());
+        ParticleModel::AtomType *type = model->atomType[typeID[c]];
+        if (c < categoryColor.size())  type->color  = categoryColor[c];
+        if (c < categoryRadius.size()) type->radius = categoryRadius[c];
+      }
+      for (size_t i=0;i<category.size();i++)
+        model->type.push_back(typeID[category[i]]);
+    }
+
+    void importModel(ParticleModel *model, const ospcommon::FileName &fileName)
+    {
+      xml::XMLDoc *doc = xml::readXML(fileName);
+      assert(doc);
+      const std::string binFileName = fileName.str()+"bin";
+      FILE *bin = fopen(binFileName.c_str(),"rb");
+      if (!bin)
+        throw std::runtime_error("could not open "+binFileName);
+      for (size_t i=0;i<doc->child.size();i++)
+        for (size_t j=0;j<doc->child[i]->child.size();j++)
+          if (doc->child[i]->child[j]->name == "PKDGeometry")
+            importGeometry(model,doc->child[i]->child[j],bin);
+      fclose(bin);
+      delete doc;
+    }
+  }
+}
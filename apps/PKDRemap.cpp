@@ -0,0 +1,153 @@
+// ======================================================================== //
+// Copyright 2009-2014 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! \file PKDRemap.cpp brings a per-particle array given in the input
+    order of ospPartiKD (e.g., an attribute of a later timestep) into
+    the tree order of a .pkd file, using the permutation the builder
+    wrote with '--permutation' */
+
+#include "ospray/common/OSPCommon.h"
+#include "apps/common/xml/XML.h"
+#include "../ospray/ParallelFor.h"
+// std
+#include <string.h>
+#include <vector>
+
+namespace ospray {
+  using std::endl;
+  using std::cout;
+
+  void usage(const std::string &err = "")
+  {
+    if (err != "")
+      cout << "Error: " << err << endl << endl;
+    cout << "Usage:" << endl;
+    cout << "  ./ospPKDRemap model.pkd input.raw -o output.raw [--element-size <bytes>]" << endl;
+    cout << "(input.raw holds one element per particle, in the builder's input order;" << endl;
+    cout << " elements default to 4 bytes, i.e., one float)" << endl;
+    exit(err == "" ? 0 : 1);
+  }
+
+  //! read the builder's permutation (tree order -> input order) of the given .pkd file
+  std::vector<uint64> readPermutation(const std::string &pkdFileName)
+  {
+    xml::XMLDoc *doc = xml::readXML(pkdFileName);
+    assert(doc);
+    const xml::Node *permutation = NULL;
+    for (size_t i=0;i<doc->child.size();i++)
+      for (size_t j=0;j<doc->child[i]->child.size();j++) {
+        const xml::Node *geom = doc->child[i]->child[j];
+        if (geom->name != "PKDGeometry") continue;
+        for (size_t k=0;k<geom->child.size();k++)
+          if (geom->child[k]->name == "permutation")
+            permutation = geom->child[k];
+      }
+    if (!permutation)
+      throw std::runtime_error("no <permutation> in '"+pkdFileName
+                               +"' (re-run ospPartiKD with '--permutation')");
+
+    const size_t ofs   = permutation->getPropl("ofs");
+    const size_t count = permutation->getPropl("count");
+    delete doc;
+
+    std::vector<uint64> perm(count);
+    const std::string binFileName = pkdFileName+"bin";
+    FILE *bin = fopen(binFileName.c_str(),"rb");
+    if (!bin)
+      throw std::runtime_error("could not open '"+binFileName+"'");
+    fseek(bin,ofs,SEEK_SET);
+    const size_t numRead = fread(&perm[0],sizeof(uint64),count,bin);
+    fclose(bin);
+    if (numRead != count)
+      throw std::runtime_error("could not read permutation from '"+binFileName+"'");
+    return perm;
+  }
+
+  //! out[i] = in[perm[i]], for elements of 'elementSize' bytes
+  void permute(unsigned char *out, const unsigned char *in,
+               const std::vector<uint64> &perm, size_t elementSize)
+  {
+    parallelForBlocks(perm.size(),64*1024,[&](size_t begin, size_t end) {
+        for (size_t i=begin;i<end;i++)
+          memcpy(out+i*elementSize,in+perm[i]*elementSize,elementSize);
+      });
+  }
+
+  void pkdRemapMain(int ac, char **av)
+  {
+    std::string pkdFileName, inFileName, outFileName;
+    size_t elementSize = sizeof(float);
+
+    for (int i=1;i<ac;i++) {
+      const std::string arg = av[i];
+      if (arg[0] == '-') {
+        if (arg == "-o" && i+1 < ac) {
+          outFileName = av[++i];
+        } else if (arg == "--element-size" && i+1 < ac) {
+          elementSize = atol(av[++i]);
+        } else if (arg == "--help" || arg == "-h") {
+          usage();
+        } else
+          usage("unknown parameter '"+arg+"'");
+      } else if (pkdFileName == "")
+        pkdFileName = arg;
+      else if (inFileName == "")
+        inFileName = arg;
+      else
+        usage("too many input files");
+    }
+    if (pkdFileName == "" || inFileName == "")
+      usage("no input specified");
+    if (outFileName == "")
+      usage("no output specified");
+    if (elementSize == 0)
+      usage("invalid element size");
+
+    const std::vector<uint64> perm = readPermutation(pkdFileName);
+    const size_t numBytes = perm.size()*elementSize;
+    cout << "#osp:pkd: remapping " << perm.size() << " elements of "
+         << elementSize << " byte(s)" << endl;
+
+    std::vector<unsigned char> in(numBytes), out(numBytes);
+    FILE *inFile = fopen(inFileName.c_str(),"rb");
+    if (!inFile)
+      throw std::runtime_error("could not open '"+inFileName+"'");
+    const size_t numRead = fread(&in[0],1,numBytes,inFile);
+    fclose(inFile);
+    if (numRead != numBytes)
+      throw std::runtime_error("'"+inFileName+"' has fewer than one element per particle");
+
+    permute(&out[0],&in[0],perm,elementSize);
+
+    FILE *outFile = fopen(outFileName.c_str(),"wb");
+    if (!outFile)
+      throw std::runtime_error("could not open '"+outFileName+"'");
+    fwrite(&out[0],1,numBytes,outFile);
+    fclose(outFile);
+    cout << "#osp:pkd: done." << endl;
+  }
+}
+
+int main(int ac, char **av)
+{
+  try {
+    ospray::pkdRemapMain(ac,av);
+  } catch (std::runtime_error e) {
+    std::cout << "#osp:pkd (fatal): " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -20,6 +20,8 @@
 
 #include "ospcommon/constants.h"
 #include "ospcommon/FileName.h"
+// std
+#include <algorithm>
 
 #define CHECK 1
 
@@ -108,7 +110,7 @@ namespace ospray {
 #if DIM_ROUND_ROBIN
     const size_t dim = depth % 3;
 #else
-    const size_t dim = maxDim(bounds.size());
+    const size_t dim = roundRobin ? depth % 3 : maxDim(bounds.size());
     // if (depth < 4) { PRINT(bounds); printf("depth %ld-> dim %ld\n",depth,dim); }
 #endif
     const size_t N = numParticles;
@@ -313,6 +315,188 @@ namespace ospray {
       }
   }
 
+  /*! statistics over a subtree, accumulated bottom-up when computing
+      the aggregates */
+  struct PartiKD::SubtreeStats {
+    SubtreeStats() 
+      : bounds(ospcommon::empty), attributeSum(0.), count(0)
+    { sum[0] = sum[1] = sum[2] = 0.; }
+
+    void extend(const SubtreeStats &other) 
+    {
+      bounds.extend(other.bounds);
+      for (int i=0;i<3;i++) sum[i] += other.sum[i];
+      attributeSum += other.attributeSum;
+      count += other.count;
+    }
+
+    box3f  bounds;
+    double sum[3];
+    double attributeSum;
+    size_t count;
+  };
+
+  struct PKDAggregateJob {
+    PartiKD *const pkd;
+    const size_t nodeID;
+    PartiKD::SubtreeStats *const stats;
+    const size_t depth;
+    __forceinline PKDAggregateJob(PartiKD *pkd, size_t nodeID, PartiKD::SubtreeStats *stats, size_t depth) 
+      : pkd(pkd), nodeID(nodeID), stats(stats), depth(depth) 
+    {};
+  };
+
+  void *pkdAggregateThread(void *arg)
+  {
+    PKDAggregateJob *job = (PKDAggregateJob *)arg;
+    job->pkd->computeAggregatesRec(job->nodeID,*job->stats,job->depth);
+    delete job;
+    return NULL;
+  } 
+
+  void PartiKD::computeAggregatesRec(const size_t nodeID, 
+                                     SubtreeStats &stats,
+                                     const size_t depth)
+  {
+    if (!isValidNode(nodeID))
+      return;
+
+    SubtreeStats lStats, rStats;
+    if ((numLevels - depth) > 20) {
+      pthread_t lThread;
+      pthread_create(&lThread,NULL,pkdAggregateThread,
+                     new PKDAggregateJob(this,leftChildOf(nodeID),&lStats,depth+1));
+      computeAggregatesRec(rightChildOf(nodeID),rStats,depth+1);
+      void *ret = NULL;
+      pthread_join(lThread,&ret);
+    } else {
+      computeAggregatesRec(leftChildOf(nodeID),lStats,depth+1);
+      computeAggregatesRec(rightChildOf(nodeID),rStats,depth+1);
+    }
+
+    stats = lStats;
+    stats.extend(rStats);
+
+    const vec3f &p = model->position[nodeID];
+    stats.bounds.extend(p);
+    stats.sum[0] += p.x;
+    stats.sum[1] += p.y;
+    stats.sum[2] += p.z;
+    stats.attributeSum += aggregateAttributeOf(nodeID);
+    stats.count++;
+
+    if (nodeID < aggregate.size()) {
+      PKDAggregate &agg = aggregate[nodeID];
+      const double rcpCount = 1./stats.count;
+      agg.centroid = vec3f(stats.sum[0]*rcpCount,
+                           stats.sum[1]*rcpCount,
+                           stats.sum[2]*rcpCount);
+      // distance to the farthest corner of the subtree's bounding box
+      const vec3f farthest = max(abs(stats.bounds.lower-agg.centroid),
+                                 abs(stats.bounds.upper-agg.centroid));
+      // (particle centers only; saveAggregates() adds the particle radius)
+      agg.radius       = length(farthest);
+      agg.attribute    = stats.attributeSum*rcpCount;
+      agg.reserved     = 0;
+      agg.numParticles = stats.count;
+    }
+  }
+
+  void PartiKD::computeAggregates()
+  {
+    aggregate.clear();
+    if (numAggregateLevels == 0 || numInnerNodes == 0)
+      return;
+
+    const size_t numAggregates
+      = std::min((size_t(1) << std::min(numAggregateLevels,size_t(62)))-1,numInnerNodes);
+    aggregate.resize(numAggregates);
+
+    SubtreeStats rootStats;
+    computeAggregatesRec(0,rootStats,0);
+    std::cout << "#osp:pkd: computed " << numAggregates << " subtree aggregates ("
+              << numAggregates*sizeof(PKDAggregate) << " bytes)" << std::endl;
+  }
+
+  //! write the aggregates, transformed by given scale and offset
+  void PartiKD::saveAggregates(FILE *xml, FILE *bin, const vec3f &scale, const vec3f &offset)
+  {
+    if (aggregate.empty())
+      return;
+
+    fprintf(xml,"<aggregate ofs=\"%li\" count=\"%li\" format=\"pkdAggregate2\"/>\n",
+            ftell(bin),aggregate.size());
+    const float radiusScale = reduce_max(scale);
+    for (size_t i=0;i<aggregate.size();i++) {
+      PKDAggregate agg = aggregate[i];
+      agg.centroid = (agg.centroid - offset) * scale;
+      // the particle radius gets written (and used) as is, so only
+      // the extent of the centers gets scaled
+      agg.radius   = agg.radius * radiusScale + model->getMaxRadius();
+      fwrite(&agg,sizeof(agg),1,bin);
+    }
+  }
+
+  /*! write the per-particle colors (if any), in kd-tree order */
+  void PartiKD::saveColor(FILE *xml, FILE *bin)
+  {
+    if (model->color.empty()) return;
+    fprintf(xml,"<color ofs=\"%li\" count=\"%li\" format=\"rgba8\"/>\n",
+            ftell(bin),numParticles);
+    fwrite(&model->color[0],sizeof(uint32),numParticles,bin);
+  }
+
+  /*! write the particle types (if any) as categorical channel - as
+      uint8 if there are few enough types, else as uint16 - plus the
+      types' colors as palette */
+  void PartiKD::saveCategory(FILE *xml, FILE *bin)
+  {
+    if (model->type.empty()) return;
+    const size_t numTypes = std::max(model->atomType.size(),
+                                     (size_t)*std::max_element(model->type.begin(),
+                                                               model->type.end())+1);
+    if (numTypes > (1<<16))
+      throw std::runtime_error("too many particle types for a categorical channel");
+    const bool useUInt8 = numTypes <= (1<<8);
+    fprintf(xml,"<category ofs=\"%li\" count=\"%li\" format=\"%s\"/>\n",
+            ftell(bin),numParticles,useUInt8?"uint8":"uint16");
+    if (useUInt8) {
+      const std::vector<uint8> category(model->type.begin(),model->type.end());
+      fwrite(&category[0],sizeof(uint8),category.size(),bin);
+    } else {
+      const std::vector<uint16> category(model->type.begin(),model->type.end());
+      fwrite(&category[0],sizeof(uint16),category.size(),bin);
+    }
+    if (!model->atomType.empty()) {
+      fprintf(xml,"<categoryColor ofs=\"%li\" count=\"%li\" format=\"vec3f\"/>\n",
+              ftell(bin),model->atomType.size());
+      for (size_t i=0;i<model->atomType.size();i++)
+        fwrite(&model->atomType[i]->color,sizeof(vec3f),1,bin);
+    }
+    // per-type radii, if any type overrides the default; types with a
+    // radius of 0 use the geometry's 'radius'
+    bool haveTypeRadius = false;
+    for (size_t i=0;i<model->atomType.size();i++)
+      haveTypeRadius |= model->atomType[i]->radius > 0.f;
+    if (haveTypeRadius) {
+      fprintf(xml,"<categoryRadius ofs=\"%li\" count=\"%li\" format=\"float\"/>\n",
+              ftell(bin),model->atomType.size());
+      for (size_t i=0;i<model->atomType.size();i++)
+        fwrite(&model->atomType[i]->radius,sizeof(float),1,bin);
+    }
+  }
+
+  /*! write, for each particle in tree order, its index in the input;
+      ospPKDRemap uses this to bring attributes of later timesteps
+      into tree order without rebuilding the tree */
+  void PartiKD::savePermutation(FILE *xml, FILE *bin)
+  {
+    if (model->inputIndex.empty()) return;
+    fprintf(xml,"<permutation ofs=\"%li\" count=\"%li\" format=\"uint64\"/>\n",
+            ftell(bin),numParticles);
+    fwrite(&model->inputIndex[0],sizeof(uint64),numParticles,bin);
+  }
+
   inline void PartiKD::swap(const size_t a, const size_t b) const 
   { 
     std::swap(model->position[a],model->position[b]);
@@ -320,6 +504,10 @@ namespace ospray {
       std::swap(model->attribute[i]->value[a],model->attribute[i]->value[b]);
     if (!model->type.empty())
       std::swap(model->type[a],model->type[b]);
+    if (!model->color.empty())
+      std::swap(model->color[a],model->color[b]);
+    if (!model->inputIndex.empty())
+      std::swap(model->inputIndex[a],model->inputIndex[b]);
   }
 
   void PartiKD::build(ParticleModel *model) 
@@ -354,7 +542,14 @@ namespace ospray {
     const box3f &bounds = model->getBounds();
     std::cout << "#osp:pkd: bounds of model " << bounds << std::endl;
     std::cout << "#osp:pkd: number of input particles " << numParticles << std::endl;
+    if (storePermutation && model->inputIndex.empty()) {
+      model->inputIndex.resize(numParticles);
+      for (size_t i=0;i<numParticles;i++)
+        model->inputIndex[i] = i;
+    }
     buildRec(0,bounds,0);
+
+    computeAggregates();
   }
 
   //! save to xml+binary file(s)
@@ -425,9 +620,15 @@ namespace ospray {
       uint64 quantized = (ix << 2) | (iy << 22) | (iz << 42) | dim;
       fwrite(&quantized,sizeof(quantized),1,bin);
     }
+    saveAggregates(xml,bin,vec3f(1<<20)/(bounds.upper-bounds.lower),bounds.lower);
+    saveColor(xml,bin);
+    saveCategory(xml,bin);
+    savePermutation(xml,bin);
 
     if (model->radius > 0.)
       fprintf(xml,"<radius>%f</radius>\n",model->radius);
+    if (roundRobin)
+      fprintf(xml,"<dimFromDepth value=\"1\"/>\n");
     fprintf(xml,"<useOldAlphaSpheresCode value=\"0\"/>\n");
     fprintf(xml,"</PKDGeometry>\n");
   }
@@ -446,16 +647,14 @@ namespace ospray {
               attr->name.c_str(),ftell(bin),numParticles);
       fwrite(&attr->value[0],sizeof(float),numParticles,bin);
     }
-    if (!model->type.empty()) {
-      float *f = new float[model->type.size()];
-      for (int i=0;i<model->type.size();i++) f[i] = model->type[i];
-      fprintf(xml,"<attribute name=\"atomType\" ofs=\"%li\" count=\"%li\" format=\"float\"/>\n",
-              ftell(bin),numParticles);
-      fwrite(f,sizeof(float),numParticles,bin);
-      delete[] f;
-    }
+    saveAggregates(xml,bin,vec3f(1.f),vec3f(0.f));
+    saveColor(xml,bin);
+    saveCategory(xml,bin);
+    savePermutation(xml,bin);
     if (model->radius > 0.)
       fprintf(xml,"<radius>%f</radius>\n",model->radius);
+    if (roundRobin)
+      fprintf(xml,"<dimFromDepth value=\"1\"/>\n");
     fprintf(xml,"<useOldAlphaSpheresCode value=\"0\"/>\n");
     fprintf(xml,"</PKDGeometry>\n");
 
@@ -469,6 +668,14 @@ namespace ospray {
     std::string output, outputQuantized;
     ParticleModel model;
     bool roundRobin = false;
+    bool storePermutation = false;
+    size_t numAggregateLevels = 16;
+    std::vector<std::pair<std::string,float> > typeRadius;
+    // particle selection, e.g., to build a compacted tree over only
+    // what a transfer function shows
+    std::string keepAttribute;
+    float keepLo = 0.f, keepHi = 0.f;
+    std::vector<std::string> hideType;
 
     for (int i=1;i<ac;i++) {
       std::string arg = av[i];
@@ -477,12 +684,37 @@ namespace ospray {
           output = av[++i];
         } else if (arg == "--radius") {
           model.radius = atof(av[++i]);
+        } else if (arg == "--type-radius") {
+          // <typename>=<radius>
+          const std::string spec = i+1 < ac ? av[++i] : "";
+          const size_t eq = spec.find('=');
+          if (eq == std::string::npos || eq == 0)
+            throw std::runtime_error("'--type-radius' expects <type>=<radius>");
+          typeRadius.push_back(std::make_pair(spec.substr(0,eq),
+                                              (float)atof(spec.c_str()+eq+1)));
         } else if (arg == "--quantize") {
           if (i+1 >= ac || av[i+1][0] == '-')
             throw std::runtime_error("no filename passed to '--quantize'");
           outputQuantized = av[++i];
+        } else if (arg == "--keep-range") {
+          // <attribute> <lo> <hi>
+          if (i+3 >= ac)
+            throw std::runtime_error("'--keep-range' expects <attribute> <lo> <hi>");
+          keepAttribute = av[++i];
+          keepLo = atof(av[++i]);
+          keepHi = atof(av[++i]);
+        } else if (arg == "--hide-type") {
+          if (i+1 >= ac)
+            throw std::runtime_error("no type name passed to '--hide-type'");
+          hideType.push_back(av[++i]);
+        } else if (arg == "--permutation") {
+          storePermutation = true;
         } else if (arg == "--round-robin") {
           roundRobin = true;
+        } else if (arg == "--aggregate-levels") {
+          if (i+1 >= ac)
+            throw std::runtime_error("no number of levels passed to '--aggregate-levels'");
+          numAggregateLevels = atol(av[++i]);
         } else {
           throw std::runtime_error("unknown parameter '"+arg+"'");
         }
@@ -504,6 +736,42 @@ namespace ospray {
       cout << "#osp:pkd: loading " << input[i] << endl;
       model.load(input[i]);
     }
+    for (size_t i=0;i<typeRadius.size();i++) {
+      cout << "#osp:pkd: radius of type '" << typeRadius[i].first
+           << "' is " << typeRadius[i].second << endl;
+      model.atomType[model.getAtomTypeID(typeRadius[i].first)]->radius = typeRadius[i].second;
+    }
+
+    // index the particles in input order before any selection, so the
+    // permutation refers to the input rather than to what got kept
+    // (re-imported .pkd files already carry their own input index)
+    if (storePermutation || !model.inputIndex.empty())
+      for (size_t i=model.inputIndex.size();i<model.position.size();i++)
+        model.inputIndex.push_back(i);
+
+    if (keepAttribute != "" || !hideType.empty()) {
+      std::vector<bool> keep(model.position.size(),true);
+      if (keepAttribute != "") {
+        if (!model.hasAttribute(keepAttribute))
+          throw std::runtime_error("no attribute '"+keepAttribute+"' to select by");
+        const std::vector<float> &value = model.getAttribute(keepAttribute)->value;
+        for (size_t i=0;i<keep.size();i++)
+          keep[i] = value[i] >= keepLo && value[i] <= keepHi;
+      }
+      for (size_t t=0;t<hideType.size();t++) {
+        if (model.atomTypeByName.find(hideType[t]) == model.atomTypeByName.end())
+          throw std::runtime_error("no particle type '"+hideType[t]+"' to hide");
+        const int typeID = model.atomTypeByName[hideType[t]];
+        for (size_t i=0;i<model.type.size();i++)
+          if (model.type[i] == typeID) keep[i] = false;
+      }
+      const size_t numBefore = model.position.size();
+      model.select(keep);
+      cout << "#osp:pkd: selected " << model.position.size() << " of "
+           << numBefore << " particles" << endl;
+      if (model.position.empty())
+        throw std::runtime_error("no particles selected");
+    }
 
     if (model.radius == 0.f) {
       throw std::runtime_error("no radius specified via either command line or model file");
@@ -551,7 +819,8 @@ namespace ospray {
 
     double before = getSysTime();
     std::cout << "#osp:pkd: building tree ..." << std::endl;
-    PartiKD partiKD(roundRobin);
+    PartiKD partiKD(roundRobin,numAggregateLevels);
+    partiKD.storePermutation = storePermutation;
     partiKD.build(&model);
     double after = getSysTime();
     std::cout << "#osp:pkd: tree built (" << (after-before) << " sec)" << std::endl;
@@ -577,7 +846,7 @@ int main(int ac, char **av)
   } catch (std::runtime_error(e)) {
     cout << "#osp:pkd (fatal): " << e.what() << endl;
     cout << "usage:" << endl;
-    cout << "./ospPartiKD <inputfile(s)> -o output.pkd --radius <radius> [--round-robin] [--quantize quantized.pkd]\n" << endl;
+    cout << "./ospPartiKD <inputfile(s)> -o output.pkd --radius <radius> [--round-robin] [--quantize quantized.pkd] [--aggregate-levels <n>] [--type-radius <type>=<radius>] [--permutation] [--keep-range <attribute> <lo> <hi>] [--hide-type <type>]\n" << endl;
     
   }
 }
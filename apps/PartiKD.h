@@ -17,6 +17,7 @@
 #pragma once
 
 #include "ParticleModel.h"
+#include "../ospray/PKDAggregate.h"
 
 namespace ospray {
 
@@ -32,12 +33,28 @@ namespace ospray {
     size_t numLevels;
     int roundRobin;
 
-    PartiKD(bool roundRobin=0) 
-      : model(NULL), numParticles(0), numInnerNodes(0), roundRobin(roundRobin)
+    /*! number of top-most tree levels to compute subtree aggregates
+        for (0 means 'no aggregates') */
+    size_t numAggregateLevels;
+    /*! one aggregate per inner node in the top 'numAggregateLevels'
+        levels, in node order */
+    std::vector<PKDAggregate> aggregate;
+
+    /*! whether to track and save the permutation from input to tree
+        order (see ParticleModel::inputIndex) */
+    bool storePermutation;
+
+    PartiKD(bool roundRobin=0, size_t numAggregateLevels=16) 
+      : model(NULL), numParticles(0), numInnerNodes(0), roundRobin(roundRobin),
+        numAggregateLevels(numAggregateLevels), storePermutation(false)
     {};
 
     //! build particle tree over given model. WILL REORDER THE MODEL'S ELEMENTS
     void build(ParticleModel *model);
+
+    /*! compute the subtree aggregates for the top levels of the
+        (already built) tree */
+    void computeAggregates();
     
     //! save to xml+binary file
     void saveOSP(const std::string &fileName);
@@ -62,6 +79,31 @@ namespace ospray {
     
     __forceinline float pos(const size_t nodeID, const size_t dim) const { return model->position[nodeID][dim]; }
 
+    /*! value that goes into the aggregates' mean attribute: the first
+        attribute (or the particle type, if there is none), matching
+        what saveOSP writes out first */
+    __forceinline float aggregateAttributeOf(const size_t nodeID) const
+    {
+      if (!model->attribute.empty()) return model->attribute[0]->value[nodeID];
+      if (!model->type.empty()) return model->type[nodeID];
+      return 0.f;
+    }
+
+    struct SubtreeStats;
+    void computeAggregatesRec(const size_t nodeID, SubtreeStats &stats, const size_t depth);
+
+    //! write the aggregates, transformed by given scale and offset
+    void saveAggregates(FILE *xml, FILE *bin, const vec3f &scale, const vec3f &offset);
+
+    //! write the per-particle colors (if the model has any)
+    void saveColor(FILE *xml, FILE *bin);
+
+    //! write the input index of each particle (if tracked)
+    void savePermutation(FILE *xml, FILE *bin);
+
+    //! write the particle types (if the model has any) as categories
+    void saveCategory(FILE *xml, FILE *bin);
+
     void buildRec(const size_t nodeID, const box3f &bounds, const size_t depth) const;
 
     //! helper function for building - swap two particles in the model
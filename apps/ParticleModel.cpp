@@ -24,6 +24,7 @@ namespace ospray {
   namespace xyz { void importModel(ParticleModel *model, const ospcommon::FileName &s); }
   namespace cosmos { void importModel(ParticleModel *model, const ospcommon::FileName &s); }
   namespace cosmic_web { void importModel(ParticleModel *model, const ospcommon::FileName &s); }
+  namespace pkd { void importModel(ParticleModel *model, const ospcommon::FileName &s); }
 #if PARTIKD_LIDAR_ENABLED
   namespace las { void importModel(ParticleModel *model, const ospcommon::FileName &s); }
 #endif
@@ -77,6 +78,9 @@ namespace ospray {
     } else if (fn.ext() == "cosmos") {
       // assume uintah format
       cosmos::importModel(this,fn);
+    } else if (fn.ext() == "pkd") {
+      // re-import a tree we built before
+      pkd::importModel(this,fn);
     }
 #if PARTIKD_LIDAR_ENABLED
     else if (fn.ext() == "las" || fn.ext() == "laz"){
@@ -100,6 +104,36 @@ namespace ospray {
     return atomTypeByName[name];
   }
 
+  float ParticleModel::getMaxRadius() const
+  {
+    float maxRadius = radius;
+    for (size_t i=0;i<atomType.size();i++)
+      maxRadius = std::max(maxRadius,atomType[i]->radius);
+    return maxRadius;
+  }
+
+  //! keep only the particles for which 'keep' is set (in their current order)
+  void ParticleModel::select(const std::vector<bool> &keep)
+  {
+    size_t numKept = 0;
+    for (size_t i=0;i<position.size();i++) {
+      if (!keep[i]) continue;
+      position[numKept] = position[i];
+      if (!type.empty())       type[numKept]       = type[i];
+      if (!color.empty())      color[numKept]      = color[i];
+      if (!inputIndex.empty()) inputIndex[numKept] = inputIndex[i];
+      for (size_t a=0;a<attribute.size();a++)
+        attribute[a]->value[numKept] = attribute[a]->value[i];
+      ++numKept;
+    }
+    position.resize(numKept);
+    if (!type.empty())       type.resize(numKept);
+    if (!color.empty())      color.resize(numKept);
+    if (!inputIndex.empty()) inputIndex.resize(numKept);
+    for (size_t a=0;a<attribute.size();a++)
+      attribute[a]->value.resize(numKept);
+  }
+
   //! helper function for parser error recovery: 'clamp' all attributes to largest non-empty attribute
   void ParticleModel::cullPartialData() 
   {
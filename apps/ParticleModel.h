@@ -51,8 +51,10 @@ namespace ospray {
     struct AtomType {
       std::string name;
       vec3f       color;
+      //! radius of particles of this type (0: use the model's 'radius')
+      float       radius;
 
-      AtomType(const std::string &name) : name(name), color(1,0,0) {}
+      AtomType(const std::string &name) : name(name), color(1,0,0), radius(0.f) {}
     };
     
     //! list of all declared atom types
@@ -62,8 +64,17 @@ namespace ospray {
 
     uint32 getAtomTypeID(const std::string &name);
 
+    //! largest radius of any particle, including per-type radii
+    float getMaxRadius() const;
+
     std::vector<vec_t> position;   //!< particle position
     std::vector<int>   type;       //!< 'type' of particle (e.g., the atom type for atomistic models)
+    //! optional per-particle RGBA8 color (r in the lowest byte), e.g., for lidar data
+    std::vector<uint32> color;
+    /*! optional index of each particle in the input, tracked through
+        the (re-ordering) tree build; lets per-timestep attributes in
+        input order get mapped onto the tree later on */
+    std::vector<uint64> inputIndex;
     std::vector<Attribute *> attribute;
 #if PARTIKD_LIDAR_ENABLED
     box3f lidar_current_bounds = ospcommon::EmptyTy();
@@ -86,6 +97,9 @@ namespace ospray {
     //! helper function for parser error recovery: 'clamp' all attributes to largest non-empty attribute
     void cullPartialData();
 
+    //! keep only the particles for which 'keep' is set
+    void select(const std::vector<bool> &keep);
+
     //! return world bounding box of all particle *positions* (i.e., particles *ex* radius)
     box3f getBounds() const;
 
@@ -15,9 +15,14 @@
 // ======================================================================== //
 
 #include "../sg/PKD.h"
+#include "../ospray/SplatKernel.h"
 #include "sg/SceneGraph.h"
-// c++11
-#include <mutex>
+// std
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <atomic>
+#include <sstream>
 
 namespace ospray {
   using std::endl;
@@ -41,21 +46,72 @@ namespace ospray {
     float voxel[BLOCK_SIZE][BLOCK_SIZE][BLOCK_SIZE];
   };
   
+  /*! the output file. blocks get written with positional writes
+      (pwrite), so threads can write their blocks concurrently without
+      any locking. in bricked mode, every block is stored as one
+      contiguous BLOCK_SIZE^3 brick (padded at the volume's upper
+      boundaries), in x-fastest order of the block IDs; otherwise the
+      file is a plain x-fastest raw volume. empty blocks never get
+      written (the file is pre-sized, so they read as zeros).
+
+      sparse files are bricked, but only store the non-empty bricks,
+      in the order they got finished; 'brickOffset' then gives each
+      brick's file offset (or -1 for empty bricks) */
   struct MappedVolume3f {
-    MappedVolume3f(const vec3i dims, const std::string &rawFileName) 
-      : dims(dims)
+    MappedVolume3f(const vec3i dims, const std::string &rawFileName,
+                   bool bricked, bool sparse=false) 
+      : dims(dims), bricked(bricked || sparse), sparse(sparse),
+        numBlocks((dims+vec3i(BLOCK_SIZE-1))/vec3i(BLOCK_SIZE)),
+        numBricksWritten(0)
     {
-      file = fopen(rawFileName.c_str(),"wb");
-      if (!file) 
+      fd = open(rawFileName.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0644);
+      if (fd < 0) 
         throw std::runtime_error("could not open file '"+rawFileName+"' for writing");
+      const size_t totalBlocks = size_t(numBlocks.x)*numBlocks.y*numBlocks.z;
+      if (sparse) {
+        brickOffset.resize(totalBlocks,-1);
+        return;
+      }
+      const size_t numBytes = bricked
+        ? totalBlocks*sizeof(Block::voxel)
+        : size_t(dims.x)*dims.y*dims.z*sizeof(float);
+      if (ftruncate(fd,numBytes) != 0)
+        throw std::runtime_error("could not resize '"+rawFileName+"'");
     }
     
     ~MappedVolume3f() 
-    { fclose(file); }
+    { close(fd); }
+
+    //! write 'numBytes' at 'fileOfs', thread-safe
+    void write(const void *data, size_t numBytes, size_t fileOfs)
+    {
+      const char *ptr = (const char *)data;
+      while (numBytes > 0) {
+        const ssize_t written = pwrite(fd,ptr,numBytes,fileOfs);
+        if (written <= 0) 
+          throw std::runtime_error("error writing block data");
+        ptr += written; fileOfs += written; numBytes -= written;
+      }
+    }
     
     void writeBlock(Block &block)
+    { writeBlock(block,&block.voxel[0][0][0]); }
+
+    /*! write the (BLOCK_SIZE^3) 'voxel' array of another channel of
+        the given block */
+    void writeBlock(const Block &block, const float *voxel)
     {
-      std::lock_guard<std::mutex> lock(mutex);
+      if (bricked) {
+        const size_t brickID
+          = block.blockID.x + numBlocks.x * (block.blockID.y + size_t(numBlocks.y) * block.blockID.z);
+        size_t fileOfs = brickID*sizeof(block.voxel);
+        if (sparse) {
+          fileOfs = (numBricksWritten++)*sizeof(block.voxel);
+          brickOffset[brickID] = fileOfs;
+        }
+        write(voxel,sizeof(block.voxel),fileOfs);
+        return;
+      }
       for (size_t z=0;z<block.dims.z;z++)
         for (size_t y=0;y<block.dims.y;y++) {
           size_t dx = block.dims.x;
@@ -64,16 +120,28 @@ namespace ospray {
           size_t g_z = block.lower.z+z;
 
           size_t fileOfs = (g_x + dims.x * (g_y + dims.y * g_z))*sizeof(float);
-          fseek(file,fileOfs,SEEK_SET);
-          int written = fwrite(&block.voxel[z][y][0],sizeof(float),dx,file);
-          if (written != dx) 
-            throw std::runtime_error("error writing block data");
+          write(voxel+(z*BLOCK_SIZE+y)*BLOCK_SIZE,dx*sizeof(float),fileOfs);
         }
     }
 
-    std::mutex mutex;
-    FILE *file;
+    //! write the brick offsets of a sparse file, one int64 per brick
+    void writeBrickIndex(const std::string &indexFileName)
+    {
+      FILE *file = fopen(indexFileName.c_str(),"wb");
+      if (!file) 
+        throw std::runtime_error("could not open file '"+indexFileName+"' for writing");
+      fwrite(&brickOffset[0],sizeof(int64),brickOffset.size(),file);
+      fclose(file);
+    }
+
+    int   fd;
     vec3i dims;
+    bool  bricked;
+    bool  sparse;
+    //! number of blocks in each dimension
+    vec3i numBlocks;
+    std::atomic<size_t> numBricksWritten;
+    std::vector<int64>  brickOffset;
   };
 
   void usage(const std::string &err = "")
@@ -81,91 +149,221 @@ namespace ospray {
     if (err != "")
       cout << "Error: " << err << endl << endl;
     cout << "Usage:" << endl;
-    cout <<"  ./ospPKD2RAW inFileName.pkd -o outFileName -dims x y z --radius r --border b" << endl;
+    cout <<"  ./ospPkd2Raw inFileName.pkd -o outFileName -dims x y z --radius r --border b" << endl;
+    cout <<"               [--kernel linear|cubic|gaussian|epanechnikov] [--bricked]" << endl;
+    cout <<"               [--levels n] [--attribute name]* [--magnitude name a,b,c]*" << endl;
+    cout << "(--bricked writes each " << int(BLOCK_SIZE) << "^3 block as one contiguous brick;" << endl;
+    cout << " --levels writes a pyramid of n resolutions, each halving the previous one," << endl;
+    cout << " as sparse bricked files that leave out empty bricks;" << endl;
+    cout << " --attribute adds a channel with the SPH interpolation of the given attribute," << endl;
+    cout << " --magnitude one of the magnitude of the vector of the given attributes;" << endl;
+    cout << " all channels get computed in the same pass as the density)" << endl;
     cout << endl;
     cout << "exiting." << endl << endl;
     exit(0);
   }
 
+  /*! a per-particle value to interpolate into its own volume
+      channel, next to the density */
+  struct Channel {
+    std::string name;
+    const float *value;
+    //! storage for derived values (e.g., magnitudes)
+    std::vector<float> storage;
+  };
+
+  //! per-thread scratch space for building blocks
+  struct BlockScratch {
+    //! the particles gathered for the current block
+    std::vector<size_t> particles;
+    //! BLOCK_SIZE^3 voxels per channel
+    std::vector<float>  channelVoxel;
+  };
+
   struct Splatter
   {
     vec3f *particle;
     size_t numParticles;
     // splat radius
     float radius;
+    // scale for every splat's value
+    float weight;
+    // splat kernel (the same table the pkd_splatter renderer uses)
+    SplatKernelLUT kernel;
+    // attribute channels to interpolate along with the density
+    std::vector<Channel> channels;
 
     box3f bounds;
     float border;
 
-    vec3f getWorldPos(const vec3i &cellID, const vec3i &volumeDims)
+    //! world-space size of a voxel
+    vec3f getVoxelSize(const vec3i &volumeDims) const
     {
-      const vec3f unitCellCenter = (vec3f(cellID)+vec3f(.5f)) / vec3f(volumeDims);
-      return
-        (bounds.lower - vec3f(border))
-        + 
-        unitCellCenter*(bounds.upper-bounds.lower + 2.f*vec3f(border));
+      return (bounds.upper-bounds.lower + 2.f*vec3f(border)) / vec3f(volumeDims);
     }
 
-    inline float splatValue(float dist)
-    { 
-      if (dist >= radius) return 0.f;
-      return 1.f - dist / radius;
+    vec3f getWorldPos(const vec3i &cellID, const vec3i &volumeDims) const
+    {
+      return (bounds.lower - vec3f(border)) + (vec3f(cellID)+vec3f(.5f)) * getVoxelSize(volumeDims);
     }
 
-    float computeSampleRec(const vec3f &samplePos, size_t particleID)
+    /*! append (the IDs of) all particles in the subtree of
+        'particleID' that lie inside 'query' to 'out' */
+    void gatherRec(const box3f &query, size_t particleID, std::vector<size_t> &out)
     {
       if (particleID >= numParticles)
-        return 0;
+        return;
 
       const vec3f &particle = this->particle[particleID];
       int dim = ((int &)particle.x) & 3;
       float plane = (&particle.x)[dim];
-      float coord = (&samplePos.x)[dim];
 
-      float value = splatValue(distance(samplePos,particle));
+      if (particle.x >= query.lower.x && particle.x <= query.upper.x &&
+          particle.y >= query.lower.y && particle.y <= query.upper.y &&
+          particle.z >= query.lower.z && particle.z <= query.upper.z)
+        out.push_back(particleID);
 
-      size_t lChild = 2*particleID+1;
-      size_t rChild = 2*particleID+2;
-      if (coord >= plane) {
-        value += computeSampleRec(samplePos,rChild);
-        if (fabsf(coord-plane) < radius)
-          value += computeSampleRec(samplePos,lChild);
-      } else {
-        value += computeSampleRec(samplePos,lChild);
-        if (fabsf(coord-plane) < radius)
-          value += computeSampleRec(samplePos,rChild);
+      if ((&query.lower.x)[dim] <= plane)
+        gatherRec(query,2*particleID+1,out);
+      if ((&query.upper.x)[dim] >= plane)
+        gatherRec(query,2*particleID+2,out);
+    }
+  };
+
+  /*! fill a block: a single tree query gathers all particles whose
+      splats can reach any of the block's voxels, which then get
+      scattered into the (few) voxels within their radius. this
+      replaces one full tree traversal per voxel. every attribute
+      channel gets the Shepard-normalized SPH interpolation
+      sum(w_i*a_i)/sum(w_i) of its values, in the same pass. returns
+      false (and writes nothing) if no particle reaches the block */
+  bool buildBlock(Splatter &splatter, 
+                  MappedVolume3f &mappedVol, 
+                  std::vector<MappedVolume3f *> &channelVols,
+                  Block &block,
+                  BlockScratch &scratch)
+  {
+    const vec3f voxelSize = splatter.getVoxelSize(mappedVol.dims);
+    const vec3f origin    = splatter.bounds.lower - vec3f(splatter.border);
+    const float radius    = splatter.radius;
+    const size_t numChannels = splatter.channels.size();
+    const size_t blockVoxels = BLOCK_SIZE*BLOCK_SIZE*BLOCK_SIZE;
+
+    // world-space region of the block's voxel centers, grown by the radius
+    const box3f query(splatter.getWorldPos(block.lower,mappedVol.dims) - vec3f(radius),
+                      splatter.getWorldPos(block.upper-vec3i(1),mappedVol.dims) + vec3f(radius));
+    std::vector<size_t> &particles = scratch.particles;
+    particles.clear();
+    splatter.gatherRec(query,0,particles);
+    if (particles.empty())
+      return false;
+
+    // (all of it, so bricks at the volume's boundary get zero padding)
+    memset(block.voxel,0,sizeof(block.voxel));
+    scratch.channelVoxel.assign(numChannels*blockVoxels,0.f);
+
+    const float rcpRadius2 = 1.f/(radius*radius);
+    for (size_t i=0;i<particles.size();i++) {
+      const vec3f &p = splatter.particle[particles[i]];
+      // range of voxels (in block coordinates) whose centers the splat reaches
+      const vec3f lo = (p - vec3f(radius) - origin) / voxelSize - vec3f(.5f);
+      const vec3f hi = (p + vec3f(radius) - origin) / voxelSize - vec3f(.5f);
+      const vec3i begin = max(vec3i(0),vec3i(int(ceilf(lo.x)),int(ceilf(lo.y)),int(ceilf(lo.z)))
+                              - block.lower);
+      const vec3i end   = min(block.dims,vec3i(int(floorf(hi.x)),int(floorf(hi.y)),int(floorf(hi.z)))
+                              - block.lower + vec3i(1));
+
+      for (int z=begin.z;z<end.z;z++) {
+        const float dz = origin.z + (block.lower.z+z+.5f)*voxelSize.z - p.z;
+        for (int y=begin.y;y<end.y;y++) {
+          const float dy = origin.y + (block.lower.y+y+.5f)*voxelSize.y - p.y;
+          const float dyz2 = dy*dy+dz*dz;
+          float *row = block.voxel[z][y];
+          float w[BLOCK_SIZE];
+#pragma omp simd
+          for (int x=begin.x;x<end.x;x++) {
+            const float dx = origin.x + (block.lower.x+x+.5f)*voxelSize.x - p.x;
+            w[x] = splatter.kernel((dx*dx+dyz2)*rcpRadius2);
+            row[x] += splatter.weight * w[x];
+          }
+          for (size_t c=0;c<numChannels;c++) {
+            const float a = splatter.channels[c].value[particles[i]];
+            float *channelRow = &scratch.channelVoxel[c*blockVoxels+(z*BLOCK_SIZE+y)*BLOCK_SIZE];
+#pragma omp simd
+            for (int x=begin.x;x<end.x;x++)
+              channelRow[x] += w[x] * a;
+          }
+        }
       }
-      return value;
     }
+    mappedVol.writeBlock(block);
+
+    // normalize by the sum of kernel weights (the density, without 'weight')
+    const float *density = &block.voxel[0][0][0];
+    const float rcpWeight = 1.f/splatter.weight;
+    for (size_t c=0;c<numChannels;c++) {
+      float *channel = &scratch.channelVoxel[c*blockVoxels];
+      for (size_t v=0;v<blockVoxels;v++)
+        if (density[v] > 0.f)
+          channel[v] /= density[v]*rcpWeight;
+      channelVols[c]->writeBlock(block,channel);
+    }
+    return true;
+  }
 
-    float computeSample(const vec3f &samplePos)
+  /*! splat all blocks of 'mappedVol' (at its resolution), and of the
+      attribute channels into 'channelVols'; returns the number of
+      non-empty blocks */
+  size_t buildVolume(Splatter &splatter, MappedVolume3f &mappedVol,
+                     std::vector<MappedVolume3f *> &channelVols)
+  {
+    // one flat, dynamically scheduled loop over all blocks (whose
+    // costs vary with the local particle density)
+    const vec3i numBlocks = mappedVol.numBlocks;
+    const long long totalBlocks = (long long)numBlocks.x*numBlocks.y*numBlocks.z;
+    std::atomic<size_t> numNonEmpty(0);
+    // exceptions must not leave an omp region; the first error gets
+    // recorded, the remaining blocks skipped, and it's thrown after
+    std::atomic<bool> failed(false);
+    std::string error;
+#pragma omp parallel
     {
-#if 1
-      return computeSampleRec(samplePos,0);
-#else
-      float sum = 0.f;
-
-      for (size_t i=0;i<numParticles;i++) {
-        float dist = distance(samplePos,particle[i]);
-        sum += splatValue(dist);
+      BlockScratch scratch;
+#pragma omp for schedule(dynamic)
+      for (long long blockIdx=0;blockIdx<totalBlocks;blockIdx++) {
+        if (failed) continue;
+        const vec3i blockID(blockIdx % numBlocks.x,
+                            (blockIdx / numBlocks.x) % numBlocks.y,
+                            blockIdx / ((long long)numBlocks.x*numBlocks.y));
+        Block block(blockID,mappedVol.dims);
+        try {
+          if (buildBlock(splatter,mappedVol,channelVols,block,scratch))
+            numNonEmpty++;
+        } catch (std::runtime_error e) {
+#pragma omp critical
+          {
+            if (!failed) error = e.what();
+            failed = true;
+          }
+        }
       }
-      return sum;
-#endif
     }
-  };
+    if (failed)
+      throw std::runtime_error(error);
+    return numNonEmpty;
+  }
 
-  void buildBlock(Splatter &splatter, 
-                  MappedVolume3f &mappedVol, 
-                  Block &block)
+  //! the values of the attribute of the given name
+  const float *findAttribute(sg::PKDGeometry *pkd, const std::string &name)
   {
-    for (size_t z=0;z<block.dims.z;z++)
-      for (size_t y=0;y<block.dims.y;y++)
-        for (size_t x=0;x<block.dims.x;x++) {
-          const vec3i cell(block.lower.x+x,block.lower.y+y,block.lower.z+z);
-          const vec3f pos = splatter.getWorldPos(cell,mappedVol.dims);
-          block.voxel[z][y][x] = splatter.computeSample(pos);
-        }
-    mappedVol.writeBlock(block);
+    for (size_t i=0;i<pkd->attribute.size();i++)
+      if (pkd->attribute[i]->name == name)
+        return pkd->attribute[i]->value;
+    std::string available;
+    for (size_t i=0;i<pkd->attribute.size();i++)
+      available += " '"+pkd->attribute[i]->name+"'";
+    throw std::runtime_error("no attribute '"+name+"' in input (available:"
+                             +(available == "" ? std::string(" none") : available)+")");
   }
 
   void pkd2volume(int ac, char **av)
@@ -173,8 +371,15 @@ namespace ospray {
     std::string inFileName;
     std::string outFileName;
     vec3i dims(0);
+    bool bricked = false;
+    int numLevels = 1;
+    //! attributes to interpolate as is
+    std::vector<std::string> attributeNames;
+    //! (name, comma-separated components) of magnitude channels
+    std::vector<std::pair<std::string,std::string> > magnitudeNames;
     Splatter splatter;
     splatter.radius = 1.f;
+    splatter.weight = 1.f;
     splatter.border = .5f;
 
     for (int i=1;i<ac;i++) {
@@ -189,6 +394,21 @@ namespace ospray {
         } else if (arg == "--radius" || arg == "-r") {
           assert(i+1 < ac);
           splatter.radius = atof(av[++i]);
+        } else if (arg == "--kernel" || arg == "-k") {
+          assert(i+1 < ac);
+          splatter.kernel.build(parseSplatKernel(av[++i]));
+        } else if (arg == "--bricked") {
+          bricked = true;
+        } else if (arg == "--levels") {
+          assert(i+1 < ac);
+          numLevels = atoi(av[++i]);
+        } else if (arg == "--attribute" || arg == "-a") {
+          assert(i+1 < ac);
+          attributeNames.push_back(av[++i]);
+        } else if (arg == "--magnitude") {
+          assert(i+2 < ac);
+          const std::string name = av[++i];
+          magnitudeNames.push_back(std::make_pair(name,std::string(av[++i])));
         } else if (arg == "-dims") {
           assert(i+3 < ac);
           dims.x = atoi(av[++i]);
@@ -208,6 +428,8 @@ namespace ospray {
       usage("no output specified");
     if (dims.x < 1 || dims.y < 1 || dims.z < 1)
       usage("no valid dimensions specified");
+    if (numLevels < 1)
+      usage("invalid number of levels");
     
     Ref<sg::World> world = sg::loadOSP(inFileName);
     if (!world)
@@ -224,33 +446,122 @@ namespace ospray {
     // do the actual work
     // =======================================================
 
-    MappedVolume3f mappedVol(dims, outFileName+"bin");
-    
     splatter.particle = pkd->particle3f;
     splatter.numParticles = pkd->numParticles;
     splatter.bounds = pkd->getBounds();
-    vec3i blockID;
-#pragma omp parallel
-    for (blockID.z = 0; blockID.z*BLOCK_SIZE<dims.z; blockID.z++)
-#pragma omp parallel
-      for (blockID.y = 0; blockID.y*BLOCK_SIZE<dims.y; blockID.y++)
-#pragma omp parallel
-        for (blockID.x = 0; blockID.x*BLOCK_SIZE<dims.x; blockID.x++) {
-          Block block(blockID,dims);
-          buildBlock(splatter,mappedVol,block);
-        }
+
+    // the attribute channels, in the order given on the command line
+    // (plain attributes first); all of them get splatted in the same
+    // pass as the density
+    splatter.channels.resize(attributeNames.size()+magnitudeNames.size());
+    for (size_t i=0;i<attributeNames.size();i++) {
+      splatter.channels[i].name  = attributeNames[i];
+      splatter.channels[i].value = findAttribute(pkd.ptr,attributeNames[i]);
+    }
+    for (size_t i=0;i<magnitudeNames.size();i++) {
+      Channel &channel = splatter.channels[attributeNames.size()+i];
+      channel.name = magnitudeNames[i].first;
+      std::vector<const float *> component;
+      std::stringstream components(magnitudeNames[i].second);
+      std::string componentName;
+      while (std::getline(components,componentName,','))
+        component.push_back(findAttribute(pkd.ptr,componentName));
+      if (component.empty())
+        usage("no components specified for magnitude '"+channel.name+"'");
+      channel.storage.resize(splatter.numParticles);
+      for (size_t p=0;p<splatter.numParticles;p++) {
+        float sum2 = 0.f;
+        for (size_t c=0;c<component.size();c++)
+          sum2 += component[c][p]*component[c][p];
+        channel.storage[p] = sqrtf(sum2);
+      }
+      channel.value = &channel.storage[0];
+    }
+
+    if (numLevels == 1) {
+      MappedVolume3f mappedVol(dims, outFileName+"bin", bricked);
+      std::vector<MappedVolume3f *> channelVols;
+      for (size_t c=0;c<splatter.channels.size();c++)
+        channelVols.push_back(new MappedVolume3f(dims, outFileName+"."+splatter.channels[c].name+".bin", bricked));
+      buildVolume(splatter,mappedVol,channelVols);
+      for (size_t c=0;c<channelVols.size();c++)
+        delete channelVols[c];
+
+      // =======================================================
+      // done generating the bin file; let's write the osp file
+      // =======================================================
+      FILE *file = fopen(outFileName.c_str(),"w");
+
+      fprintf(file,"<?xml?>\n");
+      fprintf(file,"<ospray>\n");
+      fprintf(file,"  <StructuredVolume voxelType=\"float\"\n");
+      fprintf(file,"                    dimensions=\"%i %i %i\"\n",dims.x,dims.y,dims.z);
+      fprintf(file,"                    ofs=\"0\"\n");
+      if (bricked)
+        fprintf(file,"                    brickSize=\"%i\"\n",int(BLOCK_SIZE));
+      fprintf(file,"                    />\n");
+      for (size_t c=0;c<splatter.channels.size();c++) {
+        fprintf(file,"  <StructuredVolume name=\"%s\" voxelType=\"float\"\n",
+                splatter.channels[c].name.c_str());
+        fprintf(file,"                    dimensions=\"%i %i %i\"\n",dims.x,dims.y,dims.z);
+        fprintf(file,"                    file=\"%s.%s.bin\" ofs=\"0\"\n",
+                outFileName.c_str(),splatter.channels[c].name.c_str());
+        if (bricked)
+          fprintf(file,"                    brickSize=\"%i\"\n",int(BLOCK_SIZE));
+        fprintf(file,"                    />\n");
+      }
+      fprintf(file,"</ospray>\n");
+      fclose(file);
+      return;
+    }
 
     // =======================================================
-    // done generating the bin file; let's write the osp file
+    // multi-resolution pyramid: level l has half the resolution of
+    // level l-1 and is splatted directly from the tree, with twice
+    // the radius and an eighth of the weight (so voxel values stay
+    // comparable across levels). each level is a sparse bricked
+    // file plus its brick index
     // =======================================================
+    const float baseRadius = splatter.radius;
     FILE *file = fopen(outFileName.c_str(),"w");
-
     fprintf(file,"<?xml?>\n");
     fprintf(file,"<ospray>\n");
-    fprintf(file,"  <StructuredVolume voxelType=\"float\"\n");
-    fprintf(file,"                    dimensions=\"%i %i %i\"\n",dims.x,dims.y,dims.z);
-    fprintf(file,"                    ofs=\"0\"\n");
-    fprintf(file,"                    />\n");
+    fprintf(file,"  <StructuredVolumePyramid voxelType=\"float\" brickSize=\"%i\" numLevels=\"%i\">\n",
+            int(BLOCK_SIZE),numLevels);
+    for (int level=0;level<numLevels;level++) {
+      const vec3i levelDims = max(vec3i(1),(dims+vec3i((1<<level)-1))/vec3i(1<<level));
+      splatter.radius = baseRadius*(1<<level);
+      splatter.weight = 1.f/float(1<<(3*level));
+
+      std::stringstream baseName;
+      baseName << outFileName << ".l" << level;
+      MappedVolume3f mappedVol(levelDims, baseName.str()+".bin", true, true);
+      std::vector<MappedVolume3f *> channelVols;
+      for (size_t c=0;c<splatter.channels.size();c++)
+        channelVols.push_back(new MappedVolume3f(levelDims, baseName.str()+"."+splatter.channels[c].name+".bin",
+                                                 true, true));
+      const size_t numNonEmpty = buildVolume(splatter,mappedVol,channelVols);
+      mappedVol.writeBrickIndex(baseName.str()+".bricks");
+      for (size_t c=0;c<channelVols.size();c++) {
+        channelVols[c]->writeBrickIndex(baseName.str()+"."+splatter.channels[c].name+".bricks");
+        delete channelVols[c];
+      }
+      cout << "#osp:pkd: level " << level << ": " << levelDims << " voxels, "
+           << numNonEmpty << " of " << mappedVol.brickOffset.size() << " bricks non-empty" << endl;
+
+      fprintf(file,"    <level dimensions=\"%i %i %i\" radius=\"%f\" weight=\"%f\"\n",
+              levelDims.x,levelDims.y,levelDims.z,splatter.radius,splatter.weight);
+      fprintf(file,"           file=\"%s.bin\" bricks=\"%s.bricks\" numBricks=\"%i %i %i\">\n",
+              baseName.str().c_str(),baseName.str().c_str(),
+              mappedVol.numBlocks.x,mappedVol.numBlocks.y,mappedVol.numBlocks.z);
+      for (size_t c=0;c<splatter.channels.size();c++) {
+        const char *name = splatter.channels[c].name.c_str();
+        fprintf(file,"      <channel name=\"%s\" file=\"%s.%s.bin\" bricks=\"%s.%s.bricks\"/>\n",
+                name,baseName.str().c_str(),name,baseName.str().c_str(),name);
+      }
+      fprintf(file,"    </level>\n");
+    }
+    fprintf(file,"  </StructuredVolumePyramid>\n");
     fprintf(file,"</ospray>\n");
     fclose(file);
   }
@@ -258,7 +569,12 @@ namespace ospray {
 
 int main(int ac, char **av)
 {
-  ospray::pkd2volume(ac,av);
+  try {
+    ospray::pkd2volume(ac,av);
+  } catch (std::runtime_error e) {
+    std::cout << "#osp:pkd (fatal): " << e.what() << std::endl;
+    return 1;
+  }
   return 0;
 }
 
@@ -0,0 +1,45 @@
+// ======================================================================== //
+// Copyright 2009-2014 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+// ospcommon
+#include "ospcommon/vec.h"
+
+namespace ospray {
+
+  /*! summary of an entire pkd subtree, stored for the inner nodes of
+      the top-most levels of the tree (in the same order as the
+      particles, i.e., aggregate[i] summarizes the subtree rooted in
+      node i). Lets coarse LOD levels render a proxy in O(1) instead
+      of descending into the subtree.
+
+      note: the ISPC side (PKDGeometry.ih) mirrors this layout, and
+      the builder writes it verbatim into the .pkdbin file */
+  struct PKDAggregate {
+    //! mean position of all particles in the subtree
+    ospcommon::vec3f centroid;
+    //! radius around 'centroid' that bounds all particles (including their radius)
+    float            radius;
+    //! mean value of the first attribute (0 if there is none)
+    float            attribute;
+    //! (padding, so 'numParticles' is 8-byte aligned in C++ and ISPC alike)
+    uint32_t         reserved;
+    //! number of particles in the subtree (including its root)
+    uint64_t         numParticles;
+  };
+
+} // ::ospray
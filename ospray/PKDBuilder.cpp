@@ -0,0 +1,117 @@
+// ======================================================================== //
+// Copyright 2009-2014 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "PKDBuilder.h"
+// ospcommon
+#include "ospcommon/box.h"
+// std
+#include <algorithm>
+#include <thread>
+
+namespace ospray {
+
+  struct PKDBuilderState {
+    const vec3f         *particle;
+    size_t               numNodes;
+    std::vector<uint64> &nodeParticle;
+    std::vector<uint8>  &splitDim;
+    //! the particles still to be placed; each subtree owns a contiguous range
+    std::vector<uint64>  scratch;
+    bool                 dimFromDepth;
+    size_t               parallelThreshold;
+    /*! only subtrees above this depth get built on their own thread,
+        which bounds the number of threads to 2^maxParallelDepth */
+    size_t               maxParallelDepth;
+
+    PKDBuilderState(const vec3f *particle,
+                    std::vector<uint64> &nodeParticle,
+                    std::vector<uint8> &splitDim,
+                    bool dimFromDepth, size_t parallelThreshold)
+      : particle(particle), numNodes(nodeParticle.size()),
+        nodeParticle(nodeParticle), splitDim(splitDim),
+        scratch(nodeParticle), dimFromDepth(dimFromDepth),
+        parallelThreshold(parallelThreshold), maxParallelDepth(0)
+    {
+      // enough to keep all cores (and then some) busy
+      const size_t numThreads = std::max(1u,std::thread::hardware_concurrency());
+      while ((size_t(1)<<maxParallelDepth) < 2*numThreads)
+        maxParallelDepth++;
+    }
+
+    //! number of nodes in the subtree rooted in 'nodeID'
+    size_t subtreeSize(size_t nodeID) const
+    {
+      size_t size = 0;
+      for (size_t first=nodeID, width=1; first<numNodes; first=2*first+1, width*=2)
+        size += std::min(numNodes,first+width) - first;
+      return size;
+    }
+
+    /*! place the particles in scratch[begin..begin+subtreeSize(nodeID))
+        into the subtree rooted in 'nodeID' */
+    void buildRec(size_t nodeID, size_t begin, const box3f &bounds, size_t depth)
+    {
+      const size_t lID = 2*nodeID+1;
+      const size_t numLeft = lID < numNodes ? subtreeSize(lID) : 0;
+      const size_t size = 1 + numLeft + (lID+1 < numNodes ? subtreeSize(lID+1) : 0);
+      const int dim = dimFromDepth ? int(depth % 3) : maxDim(bounds.size());
+      splitDim[nodeID] = dim;
+
+      // the node's particle is the one that has exactly the left
+      // subtree's particles below it
+      uint64 *const first = &scratch[begin];
+      std::nth_element(first,first+numLeft,first+size,
+                       [&](uint64 a, uint64 b) { return particle[a][dim] < particle[b][dim]; });
+      nodeParticle[nodeID] = first[numLeft];
+      if (numLeft == 0)
+        return;
+
+      const float split = particle[first[numLeft]][dim];
+      box3f lBounds = bounds; lBounds.upper[dim] = split;
+      box3f rBounds = bounds; rBounds.lower[dim] = split;
+      const bool hasRight = size > numLeft+1;
+      if (hasRight && size > parallelThreshold && depth < maxParallelDepth) {
+        std::thread lThread([=]() { buildRec(lID,begin,lBounds,depth+1); });
+        buildRec(lID+1,begin+numLeft+1,rBounds,depth+1);
+        lThread.join();
+      } else {
+        buildRec(lID,begin,lBounds,depth+1);
+        if (hasRight)
+          buildRec(lID+1,begin+numLeft+1,rBounds,depth+1);
+      }
+    }
+  };
+
+  void buildPKD(const vec3f *particle,
+                std::vector<uint64> &nodeParticle,
+                std::vector<uint8> &splitDim,
+                bool dimFromDepth,
+                size_t parallelThreshold)
+  {
+    splitDim.resize(nodeParticle.size());
+    if (nodeParticle.empty())
+      return;
+
+    box3f bounds = ospcommon::empty;
+    for (size_t i=0;i<nodeParticle.size();i++)
+      bounds.extend(particle[nodeParticle[i]]);
+
+    PKDBuilderState state(particle,nodeParticle,splitDim,dimFromDepth,
+                          std::max(parallelThreshold,size_t(2)));
+    state.buildRec(0,0,bounds,0);
+  }
+
+} // ::ospray
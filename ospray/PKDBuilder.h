@@ -0,0 +1,44 @@
+// ======================================================================== //
+// Copyright 2009-2014 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+// ospray
+#include "ospray/common/OSPCommon.h"
+// std
+#include <vector>
+
+namespace ospray {
+
+  /*! builds a pkd tree (in the same heap layout as the ospPartiKD
+      builder) over a subset of an array of particles, without
+      touching the particles themselves; used to build trees at
+      runtime, e.g., over only the particles a transfer function
+      leaves visible.
+
+      on input, 'nodeParticle' lists the (indices of the) particles to
+      build over, in any order; on output, nodeParticle[n] is the
+      particle stored in tree node n, and splitDim[n] that (inner)
+      node's split dimension. subtrees of more than 'parallelThreshold'
+      particles in the top few levels (enough for twice as many threads
+      as there are cores) get built in parallel. */
+  void buildPKD(const vec3f *particle,
+                std::vector<uint64> &nodeParticle,
+                std::vector<uint8> &splitDim,
+                bool dimFromDepth,
+                size_t parallelThreshold = (1<<18));
+
+} // ::ospray
@@ -15,7 +15,12 @@
 // ======================================================================== //
 
 #include "PKDGeometry.h"
+#include "PKDBuilder.h"
 #include "PKDConfig.h"
+#include "ParallelFor.h"
+// std
+#include <cstring>
+#include <limits>
 // ospray
 #include "ospray/common/Model.h"
 // ispc exports
@@ -27,7 +32,27 @@ namespace ospray {
 
   //! Constructor
   PartiKDGeometry::PartiKDGeometry()
-    : particleRadius(.02f)
+    : particleRadius(.02f),
+      defaultRadius(.02f),
+      color(NULL),
+      aggregate(NULL),
+      numAggregates(0),
+      dimFromDepth(false),
+      lodEnabled(false),
+      lodThreshold(1.f),
+      lodPixelAngle(0.f),
+      startGridRes(0),
+      startGridRadius(0.f),
+      startGridDimFromDepth(false),
+      categoryBytes(0),
+      maxCategory(0),
+      numCategories(0),
+      visibleCategoryBits(0xffffffff),
+      prefetchMode(1),
+      maxRadiusDefault(0.f),
+      attributeBinPrecomputed(false),
+      attr_lo(0.f),
+      attr_hi(0.f)
   {
     PING;
     ispcEquivalent = ispc::PartiKDGeometry_create(this);
@@ -62,20 +87,253 @@ namespace ospray {
     return b;
   }
 
+  int getAttributeBin(float val, float lo, float hi)
+  {
+    if (hi == lo) return 0;
+    return std::max(0,std::min((int)31,int(32*((val-lo)/float(hi-lo)))));
+  }
+
   uint32 getAttributeBits(float val, float lo, float hi)
   {
     // cout << " attrbits: " << val << " (" << lo << "," << hi << ")" << endl;
-    if (hi == lo) return 1;
-    int bit = std::min((int)31,int(32*((val-lo)/float(hi-lo))));
-    return 1<<bit;
+    return 1<<getAttributeBin(val,lo,hi);
+  }
+
+  /*! largest of the 'numParticles' radii 'radius(i)' in the subtree of
+      each inner node of the top PKD_RADIUS_LEVELS levels */
+  template<typename RadiusFunc>
+  static void computeSubtreeMaxRadius(size_t numParticles, const RadiusFunc &radius,
+                                      std::vector<float> &maxRadius)
+  {
+    const size_t numInnerNodes = numParticles/2;
+    const size_t numRadiusNodes
+      = std::min(numInnerNodes,(size_t(1)<<PKD_RADIUS_LEVELS)-1);
+    maxRadius.assign(numRadiusNodes,0.f);
+    if (numRadiusNodes == 0)
+      return;
+    // every particle counts towards its deepest ancestor that stores a radius ...
+    for (size_t i=0;i<numParticles;i++) {
+      size_t nodeID = i;
+      while (nodeID >= numRadiusNodes)
+        nodeID = (nodeID-1)/2;
+      maxRadius[nodeID] = std::max(maxRadius[nodeID],radius(i));
+    }
+    // ... and those propagate up to the root
+    for (size_t nodeID=numRadiusNodes-1;nodeID>0;--nodeID)
+      maxRadius[(nodeID-1)/2] = std::max(maxRadius[(nodeID-1)/2],maxRadius[nodeID]);
+  }
+
+  PartiKDGeometry::~PartiKDGeometry()
+  {
+    if (lodCamera)
+      lodCamera->unregisterListener(this);
+    for (std::map<Data *,Ref<Data> >::iterator it=listenedData.begin();
+         it!=listenedData.end();++it)
+      it->first->unregisterListener(this);
+  }
+
+  bool PartiKDGeometry::dataChanged(const Ref<Data> &data, const Ref<Data> &last)
+  {
+    if (data && listenedData.find(data.ptr) == listenedData.end()) {
+      data->registerListener(this);
+      listenedData[data.ptr] = data;
+    }
+    return data.ptr != last.ptr || (data && committedData.count(data.ptr));
   }
 
   /*! gets called whenever any of this node's dependencies got changed */
   void PartiKDGeometry::dependencyGotChanged(ManagedObject *object)
   {
-    ispc::PartiKDGeometry_updateTransferFunction(this->getIE(),transferFunction->getIE());
+    // the LOD camera got committed: its field of view may have changed
+    if (object == lodCamera.ptr) {
+      lodPixelAngle = computeLODPixelAngle();
+      ispc::PartiKDGeometry_setLOD(getIE(),lodEnabled,lodThreshold*lodPixelAngle);
+      return;
+    }
+    // a data array got (re-)committed; the next finalize() redoes
+    // what depends on it
+    if (object != transferFunction.ptr) {
+      committedData.insert(object);
+      return;
+    }
+    // a compacted tree only holds what the old transfer function showed
+    if (!compacted.particle.empty()) {
+      cout << "#osp:pkd: transfer function changed, back to the full tree" << endl;
+      compacted.clear();
+      commitTree();
+    }
+    if (updateTransferFunction())
+      commitTree();
+  }
+
+  /*! switch to the given transfer function (listening to it instead
+      of the old one); returns whether it actually changed */
+  bool PartiKDGeometry::setTransferFunction(TransferFunction *newTransferFunction)
+  {
+    if (newTransferFunction == transferFunction.ptr)
+      return false;
+    if (transferFunction)
+      transferFunction->unregisterListener(this);
+    transferFunction = newTransferFunction;
+    if (transferFunction)
+      transferFunction->registerListener(this);
+    return true;
+  }
+
+  /*! swapping one transfer function for another only needs re-binning
+      (not a new finalize), as long as the geometry already got
+      finalized with some transfer function. everything else is left
+      to finalize(), which skips what didn't change */
+  void PartiKDGeometry::commit()
+  {
+    Geometry::commit();
+    if (!lastParticleData || !transferFunction)
+      return;
+    TransferFunction *newTransferFunction
+      = (TransferFunction*)getParamObject("transferFunction",NULL);
+    if (newTransferFunction && setTransferFunction(newTransferFunction)) {
+      const bool wasCompacted = !compacted.particle.empty();
+      compacted.clear();
+      if (updateTransferFunction() || wasCompacted)
+        commitTree();
+    }
+  }
+
+  bool PartiKDGeometry::updateTransferFunction()
+  {
+    ispc::PartiKDGeometry_updateTransferFunction(getIE(),transferFunction->getIE());
+    if (!attributeBinPrecomputed || !attribute || !attributeBin.empty()
+        || !ispc::PartiKDGeometry_transferFunctionIsBinary(getIE()))
+      return false;
+
+    attributeBin.resize(numParticles);
+    parallelForBlocks(numParticles,64*1024,[&](size_t begin, size_t end) {
+        for (size_t i=begin;i<end;i++)
+          attributeBin[i] = getAttributeBin(attribute[i],attr_lo,attr_hi);
+      });
+    cout << "#osp:pkd: binary transfer function, computed per-particle attribute bins" << endl;
+    return true;
+  }
+
+
+  /*! angle (in radians) subtended by a single pixel, for the LOD
+      screen-space error metric. can either be given directly (as
+      'lodPixelAngle'), or gets derived from the 'camera' object's
+      field of view and the 'lodImageHeight'. in the latter case we
+      listen to the camera, so zooming updates it */
+  float PartiKDGeometry::computeLODPixelAngle()
+  {
+    ManagedObject *camera = getParamObject("camera",NULL);
+    if (camera != lodCamera.ptr) {
+      if (lodCamera)
+        lodCamera->unregisterListener(this);
+      lodCamera = camera;
+      if (lodCamera)
+        lodCamera->registerListener(this);
+    }
+
+    const float pixelAngle = getParamf("lodPixelAngle",0.f);
+    if (pixelAngle > 0.f)
+      return pixelAngle;
+
+    const float fovy = camera ? camera->getParamf("fovy",60.f) : 60.f;
+    const int imageHeight = std::max(1,getParam1i("lodImageHeight",1024));
+    return 2.f*tanf(deg2rad(.5f*fovy))/imageHeight;
+  }
+
+  //! radius of the given particle
+  float PartiKDGeometry::getRadius(size_t i) const
+  {
+    if (radiusData)
+      return ((const float*)radiusData->data)[i];
+    if (categoryRadiusData) {
+      const uint32 c = getCategory(i);
+      if (c < categoryRadiusData->numItems) {
+        const float r = ((const float*)categoryRadiusData->data)[c];
+        if (r > 0.f) return r;
+      }
+    }
+    return defaultRadius;
+  }
+
+  //! category of the given particle (requires a 'category' channel)
+  uint32 PartiKDGeometry::getCategory(size_t i) const
+  {
+    if (categoryBytes == 2)
+      return ((const uint16*)categoryData->data)[i];
+    return ((const uint8*)categoryData->data)[i];
   }
 
+  /*! split dim of the given inner node (as stored in the lower two
+      bits of the particle) */
+  int PartiKDGeometry::getSplitDim(size_t nodeID) const
+  {
+    switch(format) {
+    case OSP_FLOAT3: return (int)(((const uint32&)particle3f[nodeID].x) & 3);
+    case OSP_ULONG: return (int)(particle1ul[nodeID] & 3);
+    default: NOTIMPLEMENTED;
+    };
+  }
+
+  /*! build the grid of traversal start nodes: a node gets assigned to
+      all grid cells that - grown by the particle radius - lie
+      strictly inside the node's kd-region. particles outside that
+      node's subtree (including its ancestors, which lie on the
+      region's boundary planes) then cannot overlap those cells. */
+  void PartiKDGeometry::buildStartGrid(int resolution, const box3f &gridBounds,
+                                       bool dimFromDepth)
+  {
+    startGridRes = std::max(0,resolution);
+    startGrid.clear();
+    if (startGridRes == 0)
+      return;
+
+    startGrid.resize(size_t(startGridRes)*startGridRes*startGridRes,0);
+    const float inf = std::numeric_limits<float>::infinity();
+    buildStartGridRec(0,0,box3f(vec3f(-inf),vec3f(+inf)),gridBounds,dimFromDepth);
+  }
+
+  void PartiKDGeometry::buildStartGridRec(size_t nodeID, size_t depth, const box3f &region,
+                                          const box3f &gridBounds, bool dimFromDepth)
+  {
+    if (nodeID >= numParticles/2)
+      return;
+
+    // range of cells (grown by the radius) strictly inside 'region'
+    const vec3f cellSize = gridBounds.size() * (1.f/startGridRes);
+    vec3i lo, hi;
+    for (int d=0;d<3;d++) {
+      const float l = (region.lower[d] + particleRadius - gridBounds.lower[d]) / cellSize[d];
+      const float h = (region.upper[d] - particleRadius - gridBounds.lower[d]) / cellSize[d];
+      lo[d] = (int)std::max(0.f,floorf(l)+1.f);
+      hi[d] = (int)std::min(float(startGridRes-1),ceilf(h)-2.f);
+      // no cell fits in here, nor in any of the (smaller) child regions
+      if (lo[d] > hi[d])
+        return;
+    }
+    for (int iz=lo.z;iz<=hi.z;iz++)
+      for (int iy=lo.y;iy<=hi.y;iy++)
+        for (int ix=lo.x;ix<=hi.x;ix++)
+          startGrid[ix+startGridRes*(iy+startGridRes*size_t(iz))] = nodeID;
+
+    const int   dim   = dimFromDepth ? (depth % 3) : getSplitDim(nodeID);
+    const float split = getParticle(nodeID)[dim];
+    box3f lRegion = region; lRegion.upper[dim] = split;
+    box3f rRegion = region; rRegion.lower[dim] = split;
+    buildStartGridRec(2*nodeID+1,depth+1,lRegion,gridBounds,dimFromDepth);
+    buildStartGridRec(2*nodeID+2,depth+1,rRegion,gridBounds,dimFromDepth);
+  }
+
+  /*! permute an attribute given in the input (pre-build) order into
+      tree order, where tree particle i is input particle 'perm[i]' */
+  static void permuteAttribute(float *out, const float *in, const uint64 *perm,
+                               size_t numParticles)
+  {
+    parallelForBlocks(numParticles,64*1024,[=](size_t begin, size_t end) {
+        for (size_t i=begin;i<end;i++)
+          out[i] = in[perm[i]];
+      });
+  }
 
   /*! \brief integrates this geometry's primitives into the respective
     model's acceleration structure */
@@ -97,17 +355,82 @@ namespace ospray {
     format = particleData->type;
     bool isQuantized = format == OSP_ULONG;
     PRINT(isQuantized);
-    const box3f centerBounds = getBounds();
+    // positions often stay the same across commits (e.g., when only the
+    // attribute changes per timestep); then everything that only
+    // depends on them (bounds, start grid, category and radius masks)
+    // gets reused
+    const bool positionsChanged = dataChanged(particleData,lastParticleData);
+    lastParticleData = particleData;
+    if (positionsChanged)
+      centerBounds = getBounds();
     
     attributeData = getParamData("attribute",NULL);
-    transferFunction = (TransferFunction*)getParamObject("transferFunction",NULL);
-    if (transferFunction) {
-      transferFunction->registerListener(this);
-    }
+    setTransferFunction((TransferFunction*)getParamObject("transferFunction",NULL));
 
     bool useSPMD = getParam1i("useSPMD",0);
+    // trees built with round-robin split dims can derive the dim from the depth
+    dimFromDepth = getParam1i("dimFromDepth",0);
+
+    lodEnabled    = getParam1i("lod",0);
+    lodThreshold  = getParamf("lodThreshold",1.f);
+    lodPixelAngle = computeLODPixelAngle();
+
+    // packets more divergent than this get traversed ray by ray
+    // (-1: always packets, >1: always single rays)
+    const float coherenceThreshold = getParamf("coherenceThreshold",.9f);
+
+    // categorical channel (uint8 or uint16 per particle); needed
+    // before the radii, which may be given per category
+    categoryData = getParamData("category",NULL);
+    categoryBytes = 0;
+    if (categoryData && numParticles == 0)
+      categoryData = NULL;
+    if (categoryData) {
+      categoryBytes = categoryData->numBytes / numParticles;
+      if (categoryBytes != 1 && categoryBytes != 2)
+        throw std::runtime_error("#osp:pkd: 'category' data must have one uint8 or uint16 per particle");
+    }
+
+    // radii: "radius" is the default, optionally overridden per
+    // particle ("particleRadius") or per category ("categoryRadius")
+    defaultRadius      = getParamf("radius",0.f);
+    radiusData         = getParamData("particleRadius",NULL);
+    categoryRadiusData = getParamData("categoryRadius",NULL);
+    if (numParticles == 0)
+      radiusData = categoryRadiusData = NULL;
+    if (radiusData && radiusData->numItems < numParticles)
+      throw std::runtime_error("#osp:pkd: 'particleRadius' data has fewer than one float per particle");
+    if (categoryRadiusData && !categoryData) {
+      cout << "#osp:pkd: Warning - 'categoryRadius' given without 'category' data, ignoring" << endl;
+      categoryRadiusData = NULL;
+    }
+    if (radiusData)
+      categoryRadiusData = NULL;
+    size_t numInnerNodes = numParticles/2;
 
-    particleRadius = getParamf("radius",0.f);
+    // largest radius in the subtrees of the top inner nodes, so their
+    // split planes only get widened by what the subtree actually needs
+    const bool categoryChanged
+      = dataChanged(categoryData,lastCategoryData) || positionsChanged;
+    const bool radiiChanged
+      = dataChanged(radiusData,lastRadiusData)
+      | dataChanged(categoryRadiusData,lastCategoryRadiusData)
+      || categoryChanged
+      || (categoryRadiusData && defaultRadius != maxRadiusDefault);
+    lastRadiusData         = radiusData;
+    lastCategoryRadiusData = categoryRadiusData;
+    maxRadiusDefault       = defaultRadius;
+    if (!radiusData && !categoryRadiusData)
+      innerNode_maxRadius.clear();
+    else if (radiiChanged) {
+      computeSubtreeMaxRadius(numParticles,[&](size_t i) { return getRadius(i); },
+                              innerNode_maxRadius);
+      cout << "#osp:pkd: found " << (radiusData ? "per-particle" : "per-category")
+           << " radii" << endl;
+    }
+    particleRadius = defaultRadius;
+    if (radiusData || categoryRadiusData)
+      particleRadius = innerNode_maxRadius.empty() ? getRadius(0) : innerNode_maxRadius[0];
     if (particleRadius <= 0.f)
       throw std::runtime_error("#osp:pkd: invalid radius (<= 0.f)");
     const float expectedRadius
@@ -117,49 +440,158 @@ namespace ospray {
     
     const box3f sphereBounds(centerBounds.lower - vec3f(particleRadius),
                              centerBounds.upper + vec3f(particleRadius));
-    size_t numInnerNodes = numParticles/2;
 
 
-    // compute attribute mask and attrib lo/hi values
-    float attr_lo = 0.f, attr_hi = 0.f;
+    // compute attribute mask and attrib lo/hi values - unless neither
+    // the attribute nor the positions changed since the last commit
+    permutationData = getParamData("permutation",NULL);
+    Ref<Data> inputAttributeData = getParamData("inputAttribute",NULL);
+    const bool precomputeBinIndex = getParam1i("precomputeBinIndex",1);
+    const bool attributeChanged
+      = dataChanged(attributeData,lastAttributeData)
+      | dataChanged(inputAttributeData,lastInputAttributeData)
+      | (inputAttributeData && dataChanged(permutationData,lastPermutationData))
+      || positionsChanged
+      || precomputeBinIndex     != attributeBinPrecomputed;
+    lastAttributeData       = attributeData;
+    lastInputAttributeData  = inputAttributeData;
+    lastPermutationData     = permutationData;
+    attributeBinPrecomputed = precomputeBinIndex;
+
     uint32 *binBitsArray = NULL;
-    attribute = (float*)(attributeData?attributeData->data:NULL);
+    if (!attributeChanged) {
+      binBitsArray = attributeMask.empty() ? NULL : &attributeMask[0];
+    } else {
+      attr_lo = attr_hi = 0.f;
+      attribute = (float*)(attributeData?attributeData->data:NULL);
 
-    // Attribute culling on the lidar type-punned RGB data doesn't make sense, so don't do it
-#if !PARTIKD_LIDAR_ENABLED
-    if (attribute) {
-      cout << "#osp:pkd: found attribute, computing range and min/max bit array" << endl;
-      attr_lo = attr_hi = attribute[0];
-      for (size_t i=0;i<numParticles;i++)
-        { attr_lo = std::min(attr_lo,attribute[i]); attr_hi = std::max(attr_hi,attribute[i]); }
-
-      binBitsArray = new uint32[numInnerNodes];
-      size_t numBytesRangeTree = numInnerNodes * sizeof(uint32);
-      cout << "#osp:pkd: num bytes in range tree " << numBytesRangeTree << endl;
+      // an attribute in the input order of the builder, plus the
+      // builder's permutation, replaces 'attribute'
+      permutedAttribute.clear();
+      if (inputAttributeData) {
+        if (!permutationData)
+          throw std::runtime_error("#osp:pkd: 'inputAttribute' requires 'permutation' data");
+        if (permutationData->numBytes < numParticles*sizeof(uint64))
+          throw std::runtime_error("#osp:pkd: 'permutation' data has fewer than one uint64 per particle");
+        if (inputAttributeData->numBytes < numParticles*sizeof(float))
+          throw std::runtime_error("#osp:pkd: 'inputAttribute' data has fewer than one float per particle");
+        permutedAttribute.resize(numParticles);
+        permuteAttribute(&permutedAttribute[0],(const float*)inputAttributeData->data,
+                         (const uint64*)permutationData->data,numParticles);
+        attribute = &permutedAttribute[0];
+        cout << "#osp:pkd: permuted input-order attribute into tree order" << endl;
+      }
+
+      if (attribute) {
+        cout << "#osp:pkd: found attribute, computing range and min/max bit array" << endl;
+        attr_lo = attr_hi = attribute[0];
+        for (size_t i=0;i<numParticles;i++)
+          { attr_lo = std::min(attr_lo,attribute[i]); attr_hi = std::max(attr_hi,attribute[i]); }
+
+        attributeMask.resize(numInnerNodes);
+        binBitsArray = &attributeMask[0];
+        size_t numBytesRangeTree = numInnerNodes * sizeof(uint32);
+        cout << "#osp:pkd: num bytes in range tree " << numBytesRangeTree << endl;
+        for (long long pID=numInnerNodes-1;pID>=0;--pID) {
+          size_t lID = 2*pID+1;
+          size_t rID = lID+1;
+          uint32 lBits = 0, rBits = 0;
+          if (rID < numInnerNodes)
+            rBits = binBitsArray[rID];
+          else if (rID < numParticles)
+            rBits = getAttributeBits(attribute[rID],attr_lo,attr_hi);
+          if (lID < numInnerNodes)
+            lBits = binBitsArray[lID];
+          else if (lID < numParticles)
+            lBits = getAttributeBits(attribute[lID],attr_lo,attr_hi);
+          binBitsArray[pID] = lBits|rBits;
+          // cout << " bits " << pID << " : " << (int*)lBits << " " << (int*)rBits << endl;
+        }
+        cout << "#osp:pkd: found attribute [" << attr_lo << ".." << attr_hi << "], root bits " << (int*)(int64)binBitsArray[0] << endl;
+      } else
+        attributeMask.clear();
+
+      // per-particle attribute bins, for the occlusion rays' alpha
+      // test; computed once the transfer function is binary (see
+      // updateTransferFunction())
+      attributeBin.clear();
+    }
+
+    // per-particle RGBA8 colors (independent of the attribute)
+    colorData = getParamData("color",NULL);
+    const bool colorChanged = dataChanged(colorData,lastColorData);
+    lastColorData = colorData;
+    color = (uint32*)(colorData?colorData->data:NULL);
+    if (color) {
+      if (colorData->numBytes < numParticles*sizeof(uint32))
+        throw std::runtime_error("#osp:pkd: 'color' data has fewer than one RGBA8 value per particle");
+      cout << "#osp:pkd: found per-particle RGBA8 colors" << endl;
+    }
+
+    // mask of the categories in each inner node's subtree
+    categoryVisibleData = getParamData("categoryVisible",NULL);
+    const bool categoryVisibleChanged
+      = dataChanged(categoryVisibleData,lastCategoryVisibleData);
+    lastCategoryVisibleData = categoryVisibleData;
+    categoryColorData   = getParamData("categoryColor",NULL);
+    lastCategoryData = categoryData;
+    visibleCategoryBits = 0xffffffff;
+    numCategories = 0;
+    if (!categoryData)
+      categoryMask.clear();
+    else if (categoryChanged) {
+      maxCategory = 0;
+      categoryMask.resize(numInnerNodes);
       for (long long pID=numInnerNodes-1;pID>=0;--pID) {
-        size_t lID = 2*pID+1;
-        size_t rID = lID+1;
-        uint32 lBits = 0, rBits = 0;
-        if (rID < numInnerNodes)
-          rBits = binBitsArray[rID];
-        else if (rID < numParticles)
-          rBits = getAttributeBits(attribute[rID],attr_lo,attr_hi);
-        if (lID < numInnerNodes)
-          lBits = binBitsArray[lID];
-        else if (lID < numParticles)
-          lBits = getAttributeBits(attribute[lID],attr_lo,attr_hi);
-        binBitsArray[pID] = lBits|rBits;
-        // cout << " bits " << pID << " : " << (int*)lBits << " " << (int*)rBits << endl;
+        const uint32 c = getCategory(pID);
+        maxCategory = std::max(maxCategory,c);
+        uint32 bits = 1 << (c % 32);
+        for (size_t cID=2*pID+1;cID<=2*pID+2 && cID<numParticles;cID++) {
+          if (cID < numInnerNodes)
+            bits |= categoryMask[cID];
+          else {
+            maxCategory = std::max(maxCategory,getCategory(cID));
+            bits |= 1 << (getCategory(cID) % 32);
+          }
+        }
+        categoryMask[pID] = bits;
+      }
+    }
+    if (categoryData) {
+      if (categoryVisibleData) {
+        const uint8 *visible = (const uint8*)categoryVisibleData->data;
+        numCategories = categoryVisibleData->numBytes;
+        visibleCategoryBits = 0;
+        for (uint32 c=0;c<=maxCategory;c++)
+          if (c >= numCategories || visible[c])
+            visibleCategoryBits |= 1 << (c % 32);
+        // one bit per category would cost up to 2K words per inner
+        // node for uint16 categories; categories 32 apart share a bit
+        // instead, so a subtree only gets pruned if all categories on
+        // its bits are hidden (the particles still get tested one by one)
+        if (maxCategory >= 32)
+          cout << "#osp:pkd: Warning - " << (maxCategory+1) << " categories; hiding "
+               << "them only prunes subtrees exactly for up to 32 categories" << endl;
       }
-      cout << "#osp:pkd: found attribute [" << attr_lo << ".." << attr_hi << "], root bits " << (int*)(int64)binBitsArray[0] << endl;
+      cout << "#osp:pkd: found " << (maxCategory+1) << " categories ("
+           << categoryBytes << " byte(s) each), visible bits "
+           << (int*)(int64)visibleCategoryBits << endl;
     }
-#endif
 
 
+    // subtree aggregates written by the builder, if any. these only
+    // make sense for inner nodes
+    aggregateData = getParamData("aggregate",NULL);
+    aggregate     = aggregateData ? (PKDAggregate *)aggregateData->data : NULL;
+    numAggregates = aggregateData ? std::min(aggregateData->numBytes/sizeof(PKDAggregate),
+                                             numInnerNodes) : 0;
+    if (aggregate)
+      cout << "#osp:pkd: found " << numAggregates << " subtree aggregates" << endl;
+
     // -------------------------------------------------------
     // actually create the ISPC-side geometry now
     // -------------------------------------------------------
-    ispc::PartiKDGeometry_set(getIE(),model->getIE(),isQuantized,useSPMD,
+    ispc::PartiKDGeometry_set(getIE(),model->getIE(),isQuantized,useSPMD,dimFromDepth,
                               transferFunction?transferFunction->getIE():NULL,
                               particleRadius,
                               numParticles,
@@ -168,8 +600,218 @@ namespace ospray {
                               attribute,binBitsArray,
                               (ispc::box3f&)centerBounds,(ispc::box3f&)sphereBounds,
                               attr_lo,attr_hi);
+    if (transferFunction)
+      updateTransferFunction();
+    ispc::PartiKDGeometry_setLOD(getIE(),lodEnabled,lodThreshold*lodPixelAngle);
+    ispc::PartiKDGeometry_setCoherenceThreshold(getIE(),coherenceThreshold);
+
+    // start nodes for short rays (0 disables the grid). a grid built
+    // for a larger radius stays conservative for a smaller one (with
+    // its original bounds), so shrinking the radius keeps it
+    const int startGridResolution = std::max(0,getParam1i("startGridResolution",32));
+    if (positionsChanged || startGridResolution != startGridRes
+        || particleRadius > startGridRadius || dimFromDepth != startGridDimFromDepth) {
+      buildStartGrid(startGridResolution,sphereBounds,dimFromDepth);
+      startGridRadius       = particleRadius;
+      startGridBounds       = sphereBounds;
+      startGridDimFromDepth = dimFromDepth;
+      if (startGridRes)
+        cout << "#osp:pkd: built " << startGridRes << "^3 traversal start grid" << endl;
+    }
+
+    // software prefetching (0: off, 1: children, 2: also grandchildren
+    // in the lower half of the tree levels)
+    prefetchMode = getParam1i("prefetch",1);
+
+    // optionally traverse a tree over only the visible particles. it
+    // stays valid as long as the transfer function (see
+    // dependencyGotChanged) and everything it got built from do
+    const bool compact = getParam1i("compact",0);
+    if (!compact || isQuantized
+        || positionsChanged || attributeChanged || categoryChanged || radiiChanged
+        || colorChanged || categoryVisibleChanged
+        || compacted.transferFunction != transferFunction.ptr)
+      compacted.clear();
+    if (compact && isQuantized)
+      cout << "#osp:pkd: Warning - can't compact quantized particles" << endl;
+    else if (compact && compacted.particle.empty())
+      buildCompacted(dimFromDepth,getParamf("compactMaxFraction",.5f));
+
+    // everything got (re-)computed from the current data; stop
+    // listening to (and holding on to) arrays we no longer use
+    committedData.clear();
+    for (std::map<Data *,Ref<Data> >::iterator it=listenedData.begin();
+         it!=listenedData.end();) {
+      Data *data = it->first;
+      if (data == particleData.ptr || data == attributeData.ptr
+          || data == inputAttributeData.ptr || data == permutationData.ptr
+          || data == categoryData.ptr || data == radiusData.ptr
+          || data == categoryRadiusData.ptr || data == colorData.ptr
+          || data == categoryVisibleData.ptr)
+        ++it;
+      else {
+        data->unregisterListener(this);
+        listenedData.erase(it++);
+      }
+    }
+
+    commitTree();
   }    
 
+  void PartiKDGeometry::commitTree()
+  {
+    const bool useCompacted = !compacted.particle.empty();
+    const size_t n = useCompacted ? compacted.particle.size() : numParticles;
+#define PKD_TREE_ARRAY(name,full) \
+    (useCompacted ? (compacted.name.empty() ? NULL : &compacted.name[0]) : (full))
+
+    ispc::PartiKDGeometry_setTree(getIE(),n,n/2,
+                                  (ispc::PKDParticle*)PKD_TREE_ARRAY(particle,particle3f),
+                                  PKD_TREE_ARRAY(attribute,attribute),
+                                  PKD_TREE_ARRAY(attributeMask,attributeMask.empty()?NULL:&attributeMask[0]));
+    // aggregates and start grid only exist for the full tree
+    ispc::PartiKDGeometry_setAggregates(getIE(),(ispc::PKDAggregate*)(useCompacted?NULL:aggregate),
+                                        useCompacted?0:numAggregates);
+    ispc::PartiKDGeometry_setStartGrid(getIE(),(useCompacted||startGrid.empty())?NULL:&startGrid[0],
+                                       useCompacted?0:startGridRes,(ispc::box3f&)startGridBounds);
+    ispc::PartiKDGeometry_setColor(getIE(),PKD_TREE_ARRAY(color,color));
+    ispc::PartiKDGeometry_setCategories(getIE(),
+                                        PKD_TREE_ARRAY(category,categoryData?(uint8*)categoryData->data:NULL),
+                                        categoryBytes,
+                                        PKD_TREE_ARRAY(categoryMask,categoryMask.empty()?NULL:&categoryMask[0]),
+                                        categoryVisibleData?(uint8*)categoryVisibleData->data:NULL,
+                                        numCategories,visibleCategoryBits,
+                                        categoryColorData?(ispc::vec3f*)categoryColorData->data:NULL,
+                                        categoryColorData?categoryColorData->numItems:0);
+    // the compacted tree has per-particle radii if the full one has any other than 'radius'
+    ispc::PartiKDGeometry_setRadii(getIE(),
+                                   PKD_TREE_ARRAY(radius,radiusData?(float*)radiusData->data:NULL),
+                                   (categoryRadiusData && !useCompacted)?(float*)categoryRadiusData->data:NULL,
+                                   (categoryRadiusData && !useCompacted)?categoryRadiusData->numItems:0,
+                                   defaultRadius,
+                                   PKD_TREE_ARRAY(innerNode_maxRadius,
+                                                  innerNode_maxRadius.empty()?NULL:&innerNode_maxRadius[0]),
+                                   useCompacted?compacted.innerNode_maxRadius.size():innerNode_maxRadius.size());
+    ispc::PartiKDGeometry_setAttributeBins(getIE(),PKD_TREE_ARRAY(attributeBin,
+                                                                 attributeBin.empty()?NULL:&attributeBin[0]));
+#undef PKD_TREE_ARRAY
+
+    size_t numLevels = 0;
+    while (numLevels < 64 && (size_t(1) << numLevels) <= n)
+      ++numLevels;
+    const uint64 prefetchDeepFrom = (uint64(1) << (numLevels/2)) - 1;
+    ispc::PartiKDGeometry_setPrefetch(getIE(),prefetchMode,prefetchDeepFrom);
+  }
+
+  void PartiKDGeometry::buildCompacted(bool dimFromDepth, float maxFraction)
+  {
+    compacted.clear();
+    const bool useAttribute = transferFunction && attribute;
+    const uint8 *categoryVisible
+      = (categoryData && categoryVisibleData) ? (const uint8*)categoryVisibleData->data : NULL;
+    if (!useAttribute && !categoryVisible)
+      return;
+
+    // which particles can get hit at all, in parallel
+    std::vector<uint8> visible(numParticles,1);
+    parallelForBlocks(numParticles,64*1024,[&](size_t begin, size_t end) {
+        // (the ispc side counts in int32)
+        if (useAttribute)
+          for (size_t b=begin;b<end;b+=size_t(1)<<30) {
+            const size_t e = std::min(end,b+(size_t(1)<<30));
+            ispc::PartiKDGeometry_computeOpaque(transferFunction->getIE(),attribute+b,
+                                                e-b,attr_lo,attr_hi,&visible[b]);
+          }
+        if (categoryVisible)
+          for (size_t i=begin;i<end;i++) {
+            const uint32 c = getCategory(i);
+            if (c < numCategories && !categoryVisible[c])
+              visible[i] = 0;
+          }
+      });
+
+    std::vector<uint64> &fullIndex = compacted.fullIndex;
+    for (size_t i=0;i<numParticles;i++)
+      if (visible[i]) fullIndex.push_back(i);
+    const size_t N = fullIndex.size();
+    if (N == 0 || N > maxFraction*numParticles) {
+      cout << "#osp:pkd: " << N << " of " << numParticles
+           << " particles visible, not compacting" << endl;
+      compacted.clear();
+      return;
+    }
+
+    std::vector<uint8> splitDim;
+    buildPKD(particle3f,fullIndex,splitDim,dimFromDepth);
+
+    // gather all channels into the compacted tree's node order
+    compacted.particle.resize(N);
+    for (size_t i=0;i<N;i++) {
+      vec3f p = particle3f[fullIndex[i]];
+      (uint32&)p.x = ((uint32&)p.x & ~3) | splitDim[i];
+      compacted.particle[i] = p;
+    }
+    if (attribute) {
+      compacted.attribute.resize(N);
+      for (size_t i=0;i<N;i++)
+        compacted.attribute[i] = attribute[fullIndex[i]];
+    }
+    if (!attributeBin.empty()) {
+      compacted.attributeBin.resize(N);
+      for (size_t i=0;i<N;i++)
+        compacted.attributeBin[i] = attributeBin[fullIndex[i]];
+    }
+    if (color) {
+      compacted.color.resize(N);
+      for (size_t i=0;i<N;i++)
+        compacted.color[i] = color[fullIndex[i]];
+    }
+    if (categoryData) {
+      compacted.category.resize(N*categoryBytes);
+      for (size_t i=0;i<N;i++)
+        memcpy(&compacted.category[i*categoryBytes],
+               (const uint8*)categoryData->data+fullIndex[i]*categoryBytes,categoryBytes);
+    }
+    if (radiusData || categoryRadiusData) {
+      compacted.radius.resize(N);
+      for (size_t i=0;i<N;i++)
+        compacted.radius[i] = getRadius(fullIndex[i]);
+    }
+
+    // per-node masks, bottom-up, as for the full tree
+    const size_t numInnerNodes = N/2;
+    if (!attributeMask.empty()) {
+      compacted.attributeMask.resize(numInnerNodes);
+      for (long long pID=numInnerNodes-1;pID>=0;--pID) {
+        uint32 bits = 0;
+        for (size_t cID=2*pID+1;cID<=2*pID+2 && cID<N;cID++)
+          bits |= cID < numInnerNodes
+            ? compacted.attributeMask[cID]
+            : getAttributeBits(compacted.attribute[cID],attr_lo,attr_hi);
+        compacted.attributeMask[pID] = bits;
+      }
+    }
+    if (categoryData) {
+      compacted.categoryMask.resize(numInnerNodes);
+      for (long long pID=numInnerNodes-1;pID>=0;--pID) {
+        uint32 bits = 1 << (getCategory(fullIndex[pID]) % 32);
+        for (size_t cID=2*pID+1;cID<=2*pID+2 && cID<N;cID++)
+          bits |= cID < numInnerNodes
+            ? compacted.categoryMask[cID]
+            : 1 << (getCategory(fullIndex[cID]) % 32);
+        compacted.categoryMask[pID] = bits;
+      }
+    }
+    if (!compacted.radius.empty()) {
+      computeSubtreeMaxRadius(N,[&](size_t i) { return compacted.radius[i]; },
+                              compacted.innerNode_maxRadius);
+    }
+
+    compacted.transferFunction = transferFunction.ptr;
+    cout << "#osp:pkd: compacted tree to the " << N << " of " << numParticles
+         << " particles that are visible" << endl;
+  }
+
   OSP_REGISTER_GEOMETRY(PartiKDGeometry,pkd_geometry);
 
 } // ::ospray
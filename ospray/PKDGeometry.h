@@ -19,13 +19,24 @@
 #include "ospray/geometry/Geometry.h"
 #include "ospray/common/Data.h"
 #include "ospray/transferFunction/TransferFunction.h"
+// this module
+#include "PKDAggregate.h"
+// std
+#include <map>
+#include <set>
 
 namespace ospray {
 
+  /*! number of top-most tree levels whose inner nodes store the
+      largest radius in their subtree (4MB worth); deeper split planes
+      get widened by the global maximum */
+  enum { PKD_RADIUS_LEVELS = 20 };
+
   /*! the actual ospray geometry for a PartiKD */
   struct PartiKDGeometry : public ospray::Geometry {
     //! Constructor
     PartiKDGeometry();
+    virtual ~PartiKDGeometry();
 
     //! \brief common function to help printf-debugging 
     virtual std::string toString() const { return "ospray::PartiKDGeometry"; }
@@ -38,15 +49,94 @@ namespace ospray {
     box3f getBounds() const;
     vec3f getParticle(size_t i) const;
 
-    /*! gets called whenever any of this node's dependencies got changed */
+    /*! gets called whenever any of this node's dependencies (the
+        transfer function, or any of the tracked data arrays) got
+        changed */
     virtual void dependencyGotChanged(ManagedObject *object);
 
+    /*! whether 'data' is not the array 'last' was, or got committed
+        since the last finalize(); starts listening to its commits */
+    bool dataChanged(const Ref<Data> &data, const Ref<Data> &last);
+
+    /*! \brief commit; only handles what needs no finalize() (such as
+        swapping transfer functions) */
+    virtual void commit();
+
+    /*! switch to (and listen to) the given transfer function, return
+        whether it changed */
+    bool setTransferFunction(TransferFunction *newTransferFunction);
+
+    /*! angle (in radians) subtended by a single pixel, for the LOD
+        screen-space error metric */
+    float computeLODPixelAngle();
+
+    /*! split dim of the given inner node (as stored in the lower two
+        bits of the particle) */
+    int getSplitDim(size_t nodeID) const;
+
+    /*! build the grid of traversal start nodes over 'gridBounds' (no
+        grid if 'resolution' is 0) */
+    void buildStartGrid(int resolution, const box3f &gridBounds, bool dimFromDepth);
+    void buildStartGridRec(size_t nodeID, size_t depth, const box3f &region,
+                           const box3f &gridBounds, bool dimFromDepth);
+
+    /*! build 'compacted' over only the particles that the current
+        transfer function (and category visibility) shows, if at most
+        'maxFraction' of all particles are visible */
+    void buildCompacted(bool dimFromDepth, float maxFraction);
+
+    /*! pass the per-particle and per-node arrays of the tree to
+        traverse - the compacted one if there is one, else the full
+        one - to the ISPC side */
+    void commitTree();
+
+    /*! re-bin the transfer function on the ISPC side, and compute the
+        per-particle attribute bins if it just turned binary; returns
+        whether it computed them */
+    bool updateTransferFunction();
+
     //! transfer function for color/alpha mapping, may be NULL
     Ref<TransferFunction> transferFunction;
     Ref<Data> particleData;
     Ref<Data> attributeData;
+    Ref<Data> aggregateData;
+    Ref<Data> colorData;
+    Ref<Data> categoryData;
+    Ref<Data> categoryVisibleData;
+    Ref<Data> categoryColorData;
+    Ref<Data> radiusData;
+    Ref<Data> categoryRadiusData;
+    //! tree order -> input order of the particles, as written by the builder
+    Ref<Data> permutationData;
+
+    /*! the data the position-dependent state (bounds, start grid,
+        category and radius masks) was last computed from, so commits
+        that only change the attribute don't redo it */
+    Ref<Data> lastParticleData;
+    Ref<Data> lastCategoryData;
+    Ref<Data> lastRadiusData;
+    Ref<Data> lastCategoryRadiusData;
+    float     maxRadiusDefault;
+    box3f     centerBounds;
+    //! same for the attribute range, masks and bins
+    Ref<Data> lastAttributeData;
+    Ref<Data> lastInputAttributeData;
+    Ref<Data> lastPermutationData;
+    //! same for the colors and category visibility a compacted tree copies
+    Ref<Data> lastColorData;
+    Ref<Data> lastCategoryVisibleData;
+    /*! the data arrays whose commits we listen to, and those of them
+        that got committed since the last finalize(): an app that
+        rewrites an array in place (and commits it again) keeps its
+        pointer, but still gets everything derived from it redone */
+    std::map<Data *,Ref<Data> > listenedData;
+    std::set<ManagedObject *>   committedData;
+    bool      attributeBinPrecomputed;
+    float     attr_lo, attr_hi;
 
     float    *attribute;
+    //! per-particle RGBA8 colors (r in the lowest byte), may be NULL
+    uint32   *color;
     OSPDataType format; //!< format of the particles: float3, or uint64
     union {
       void     *particle;
@@ -54,7 +144,100 @@ namespace ospray {
       uint64   *particle1ul;
     };
     size_t    numParticles;
+    //! maximum radius over all particles
     float     particleRadius;
+    /*! radius of particles without a per-particle or per-category
+        radius (the "radius" parameter) */
+    float     defaultRadius;
+
+    //! radius of the given particle
+    float getRadius(size_t i) const;
+    /*! largest radius in the subtree of each inner node of the top
+        PKD_RADIUS_LEVELS levels (empty if all particles have the same
+        radius) */
+    std::vector<float>  innerNode_maxRadius;
+
+    /*! subtree aggregates for the inner nodes of the top-most levels
+        (may be NULL) */
+    PKDAggregate *aggregate;
+    size_t        numAggregates;
+
+    /*! whether the tree was built with round-robin split dims
+        (depth%3), rather than with split dims in the particles' low
+        bits */
+    bool      dimFromDepth;
+
+    /*! level-of-detail traversal: if enabled, subtrees whose
+        projected size falls below 'lodThreshold' pixels get replaced
+        by a single proxy sphere */
+    bool      lodEnabled;
+    float     lodThreshold;
+    float     lodPixelAngle;
+    //! the camera 'lodPixelAngle' got derived from (and gets updated by)
+    Ref<ManagedObject> lodCamera;
+
+    /*! for every cell of a regular grid over the particles' bounds,
+        the deepest node whose subtree contains all particles that can
+        overlap that cell; lets short rays start traversal there
+        rather than at the root */
+    std::vector<uint64> startGrid;
+    int                 startGridRes;
+    float               startGridRadius;
+    box3f               startGridBounds;
+    bool                startGridDimFromDepth;
+
+    //! category of the given particle (requires a 'category' channel)
+    uint32 getCategory(size_t i) const;
+
+    /*! per-inner-node masks of the categories (mod 32) present in the
+        respective subtree */
+    std::vector<uint32> categoryMask;
+    int                 categoryBytes;
+    uint32              maxCategory;
+    //! number of entries in 'categoryVisible', and the visible categories (mod 32)
+    size_t              numCategories;
+    uint32              visibleCategoryBits;
+
+    /*! per-inner-node masks of the attribute bins present in the
+        respective subtree */
+    std::vector<uint32> attributeMask;
+
+    /*! 'inputAttribute' permuted into tree order (empty if the
+        attribute is given in tree order) */
+    std::vector<float>  permutedAttribute;
+
+    /*! per-particle attribute bin (0..31), so occlusion rays can do
+        their alpha test as a bit test. only computed once a binary
+        transfer function needs them (empty until then) */
+    std::vector<uint8>  attributeBin;
+
+    //! software prefetching mode (see PartiKDGeometry_setPrefetch)
+    int                 prefetchMode;
+
+    /*! a pkd tree over only the particles the current transfer
+        function (and category visibility) shows. gets traversed
+        instead of the full tree until the transfer function changes;
+        all arrays are in the compacted tree's node order (empty
+        vectors meaning the full tree doesn't have that channel
+        either) */
+    struct Compacted {
+      std::vector<vec3f>  particle;
+      //! index of each compacted particle in the full tree
+      std::vector<uint64> fullIndex;
+      std::vector<float>  attribute;
+      std::vector<uint32> attributeMask;
+      std::vector<uint8>  attributeBin;
+      std::vector<uint32> color;
+      std::vector<uint8>  category; //!< 'categoryBytes' per particle
+      std::vector<uint32> categoryMask;
+      std::vector<float>  radius;
+      std::vector<float>  innerNode_maxRadius;
+      //! the transfer function this got built for
+      const TransferFunction *transferFunction;
+
+      Compacted() : transferFunction(NULL) {}
+      void clear() { *this = Compacted(); }
+    } compacted;
   };
   
 } // ::ospray
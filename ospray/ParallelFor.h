@@ -0,0 +1,51 @@
+// ======================================================================== //
+// Copyright 2009-2014 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+// std
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+namespace ospray {
+
+  /*! split [0,n) into one contiguous block per hardware thread (but
+      no block smaller than 'minBlockSize'), and call 'fn(begin,end)'
+      on each block in a thread of its own. shared by the geometry
+      and the command line tools, which don't link ospray's tasking
+      system */
+  template<typename Fn>
+  inline void parallelForBlocks(size_t n, size_t minBlockSize, const Fn &fn)
+  {
+    const size_t maxThreads = std::max(1u,std::thread::hardware_concurrency());
+    const size_t numThreads
+      = std::max(size_t(1),std::min(maxThreads,n/std::max(minBlockSize,size_t(1))));
+    const size_t blockSize = (n+numThreads-1)/numThreads;
+    if (numThreads == 1) {
+      fn(size_t(0),n);
+      return;
+    }
+    std::vector<std::thread> threads;
+    for (size_t begin=0;begin<n;begin+=blockSize)
+      threads.push_back(std::thread([&fn,begin,blockSize,n]() {
+            fn(begin,std::min(n,begin+blockSize));
+          }));
+    for (size_t t=0;t<threads.size();t++)
+      threads[t].join();
+  }
+
+} // ::ospray
@@ -0,0 +1,113 @@
+// ======================================================================== //
+// Copyright 2009-2014 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+// std
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+/*! number of entries in a splat kernel lookup table; the ISPC side
+    (render/PKDSplatter.ispc) mirrors this value */
+#define SPLAT_KERNEL_LUT_SIZE 256
+
+namespace ospray {
+
+  /*! the radial kernels particles can get splatted with, shared by
+      the pkd_splatter renderer and pkd2volume so images and volumes
+      agree. all have a support of one splat radius, and are scaled
+      to 1 at the particle center */
+  typedef enum {
+    SPLAT_KERNEL_LINEAR = 0,
+    SPLAT_KERNEL_CUBIC_SPLINE,
+    SPLAT_KERNEL_GAUSSIAN,
+    SPLAT_KERNEL_EPANECHNIKOV
+  } SplatKernelType;
+
+  //! kernel type of the given name ("linear", "cubic", "gaussian", "epanechnikov")
+  inline SplatKernelType parseSplatKernel(const std::string &name)
+  {
+    if (name == "linear")       return SPLAT_KERNEL_LINEAR;
+    if (name == "cubic")        return SPLAT_KERNEL_CUBIC_SPLINE;
+    if (name == "gaussian")     return SPLAT_KERNEL_GAUSSIAN;
+    if (name == "epanechnikov") return SPLAT_KERNEL_EPANECHNIKOV;
+    throw std::runtime_error("#osp:pkd: unknown splat kernel '"+name
+                             +"' (use linear, cubic, gaussian, or epanechnikov)");
+  }
+
+  /*! value of the given kernel at a distance of 'q' splat radii from
+      the particle (q in [0,1]) */
+  inline float evalSplatKernel(SplatKernelType type, float q)
+  {
+    if (q >= 1.f) return 0.f;
+    switch (type) {
+    case SPLAT_KERNEL_CUBIC_SPLINE: {
+      // the M4 spline of SPH, with its support (2h) mapped to the radius
+      const float s = 2.f*q;
+      return s < 1.f
+        ? 1.f - 1.5f*s*s + .75f*s*s*s
+        : .25f*(2.f-s)*(2.f-s)*(2.f-s);
+    }
+    case SPLAT_KERNEL_GAUSSIAN:
+      // truncated at three standard deviations
+      return expf(-4.5f*q*q);
+    case SPLAT_KERNEL_EPANECHNIKOV:
+      return 1.f - q*q;
+    default:
+      return 1.f - q;
+    }
+  }
+
+  /*! a kernel tabulated over the squared normalized distance
+      q^2 = dist^2/radius^2, so evaluating it needs neither a sqrt nor
+      any transcendentals */
+  struct SplatKernelLUT {
+    SplatKernelLUT(SplatKernelType type = SPLAT_KERNEL_LINEAR)
+    { build(type); }
+
+    void build(SplatKernelType type)
+    {
+      this->type = type;
+      for (int i=0;i<SPLAT_KERNEL_LUT_SIZE;i++)
+        value[i] = evalSplatKernel(type,sqrtf((i+.5f)/SPLAT_KERNEL_LUT_SIZE));
+      // the last entry catches q^2 == 1 exactly
+      value[SPLAT_KERNEL_LUT_SIZE] = 0.f;
+
+      // integral of the kernel over the unit disc: a splat of radius
+      // r and weight w deposits w*r^2*discIntegral on the image plane
+      discIntegral = 0.f;
+      const int numSteps = 1024;
+      for (int i=0;i<numSteps;i++) {
+        const float q = (i+.5f)/numSteps;
+        const float k = evalSplatKernel(type,q);
+        discIntegral += k * 2.f*float(M_PI)*q / numSteps;
+      }
+    }
+
+    //! kernel value for a squared normalized distance q2 (>= 0)
+    inline float operator()(float q2) const
+    {
+      if (q2 >= 1.f) return 0.f;
+      return value[int(q2*SPLAT_KERNEL_LUT_SIZE)];
+    }
+
+    SplatKernelType type;
+    float value[SPLAT_KERNEL_LUT_SIZE+1];
+    float discIntegral;
+  };
+
+} // ::ospray
@@ -19,10 +19,12 @@
 // ospray
 #include "ospray/render/Renderer.h"
 #include "ospray/camera/PerspectiveCamera.h"
+#include "ospray/geometry/Instance.h"
 // ispc exports
 #include "PKDSplatter_ispc.h"
 // this module
 #include "../PKDGeometry.h"
+#include "../SplatKernel.h"
 
 namespace ospray {
   namespace pkd {
@@ -34,16 +36,88 @@ namespace ospray {
       Camera *camera;
       float splatRadius;
       float splatWeight;
+      //! the splat kernel, tabulated
+      SplatKernelLUT kernel;
+      /*! LOD error threshold in pixels (0: use the geometries' own
+          LOD settings), and the image height it refers to */
+      float lodThreshold;
+      int   lodImageHeight;
+      //! angle subtended by a pixel, and the resulting LOD error scale
+      float lodPixelAngle;
+      float lodErrorScale;
+
+      /*! progressive mode: while the camera does not move, successive
+          frames jitter their rays within the pixels (and accumulate,
+          for frame buffers with an accumulation buffer). the first
+          'progressiveLODLevels' frames splat with LOD, starting at
+          'progressiveLODThreshold' pixels and halving it every frame;
+          these don't accumulate */
+      bool  progressive;
+      int   progressiveLODLevels;
+      float progressiveLODThreshold;
+      //! frames rendered since the camera (or any parameter) last changed
+      int   frameID;
+      /*! whether a commit changed the parameters, so the next frame
+          has to clear the accumulation buffer */
+      bool  clearPending;
+      //! the camera as seen in the last frame
+      Camera *lastCamera;
+      vec3f   lastCameraPos, lastCameraDir, lastCameraUp;
+      float   lastCameraFovy;
+
+      //! whether the camera changed since the last frame (and remember it)
+      bool cameraChanged();
+
+      virtual float renderFrame(FrameBuffer *fb, const uint32 channelFlags);
+
+      /*! all pkd geometries in the model (including those in
+          instanced models), with their world-to-local transforms and
+          world-space bounds */
+      std::vector<void *>  pkdIE;
+      std::vector<affine3f> worldToLocal;
+      std::vector<box3f>   worldBounds;
+
+      //! add all pkd geometries in 'model', as transformed by 'localToWorld'
+      void collectPKDs(Model *model, const affine3f &localToWorld);
 
       virtual void commit();
     };
     
     PKDSplatter::PKDSplatter()
-      : model(NULL), camera(NULL) 
+      : model(NULL), camera(NULL), progressive(false), frameID(0), clearPending(false),
+        lastCamera(NULL)
     {
       ispcEquivalent = ispc::PKDSplatter_create(this);
    }
     
+    void PKDSplatter::collectPKDs(Model *model, const affine3f &localToWorld)
+    {
+      for (size_t i=0;i<model->geometry.size();i++) {
+        Geometry *geom = model->geometry[i].ptr;
+        if (Instance *instance = dynamic_cast<Instance *>(geom)) {
+          collectPKDs(instance->instancedScene.ptr,localToWorld*instance->xfm);
+          continue;
+        }
+        PartiKDGeometry *pkd = dynamic_cast<PartiKDGeometry *>(geom);
+        if (!pkd)
+          continue;
+
+        // world-space bounds of the (transformed) splat bounds
+        const float r = std::max(pkd->particleRadius,splatRadius);
+        const box3f local(pkd->centerBounds.lower - vec3f(r),
+                          pkd->centerBounds.upper + vec3f(r));
+        box3f world = ospcommon::empty;
+        for (int c=0;c<8;c++)
+          world.extend(xfmPoint(localToWorld,
+                                vec3f(c&1 ? local.upper.x : local.lower.x,
+                                      c&2 ? local.upper.y : local.lower.y,
+                                      c&4 ? local.upper.z : local.lower.z)));
+        pkdIE.push_back(pkd->getIE());
+        worldToLocal.push_back(rcp(localToWorld));
+        worldBounds.push_back(world);
+      }
+    }
+
     void PKDSplatter::commit()
     {
       Renderer::commit();
@@ -53,19 +127,100 @@ namespace ospray {
       camera = (Camera *)getParamObject("camera",NULL);
       splatWeight = getParamf("weight",.0001f);
       splatRadius = getParamf("radius",1.f);
+      kernel.build(parseSplatKernel(getParamString("kernel","linear")));
+      lodThreshold   = getParamf("lodThreshold",0.f);
+      lodImageHeight = std::max(1,getParam1i("lodImageHeight",1024));
+      // same pixel metric as the geometry's LOD, from our own camera
+      const float fovy = camera ? camera->getParamf("fovy",60.f) : 60.f;
+      lodPixelAngle = 2.f*tanf(deg2rad(.5f*fovy))/lodImageHeight;
+      lodErrorScale = lodThreshold * lodPixelAngle;
+
+      progressive             = getParam1i("progressive",0);
+      progressiveLODLevels    = std::max(0,getParam1i("progressiveLODLevels",4));
+      progressiveLODThreshold = getParamf("progressiveLODThreshold",8.f);
+      // any parameter change restarts the refinement (with an empty
+      // accumulation buffer, see renderFrame())
+      frameID = 0;
+      clearPending = true;
 
-      if (!model) return;
-      assert(model->geometry.size() == 1);
-      PartiKDGeometry *pkd = dynamic_cast<PartiKDGeometry *>(model->geometry[0].ptr);
-      assert(pkd);
+      pkdIE.clear();
+      worldToLocal.clear();
+      worldBounds.clear();
+      if (model)
+        collectPKDs(model,affine3f(ospcommon::one));
+      if (model && pkdIE.empty())
+        std::cout << "#osp:pkd: warning - no pkd geometries to splat" << std::endl;
 
       ispc::PKDSplatter_set(getIE(),
                             model?model->getIE():NULL,
-                            pkd?pkd->getIE():NULL,
                             camera?camera->getIE():NULL,
-                            splatRadius,splatWeight);
+                            pkdIE.empty()?NULL:&pkdIE[0],
+                            worldToLocal.empty()?NULL:(ispc::AffineSpace3f*)&worldToLocal[0],
+                            worldBounds.empty()?NULL:(ispc::box3f*)&worldBounds[0],
+                            pkdIE.size(),
+                            splatRadius,splatWeight,
+                            kernel.value,kernel.discIntegral,
+                            lodErrorScale);
     }
     
+    bool PKDSplatter::cameraChanged()
+    {
+      if (!camera)
+        return false;
+      const vec3f pos  = camera->getParam3f("pos",vec3f(0.f));
+      const vec3f dir  = camera->getParam3f("dir",vec3f(0.f,0.f,1.f));
+      const vec3f up   = camera->getParam3f("up",vec3f(0.f,1.f,0.f));
+      const float fovy = camera->getParamf("fovy",60.f);
+      const bool changed
+        = camera != lastCamera
+        || pos != lastCameraPos || dir != lastCameraDir || up != lastCameraUp
+        || fovy != lastCameraFovy;
+      lastCamera     = camera;
+      lastCameraPos  = pos;
+      lastCameraDir  = dir;
+      lastCameraUp   = up;
+      lastCameraFovy = fovy;
+      return changed;
+    }
+
+    //! i-th element of the van der Corput sequence in the given base
+    inline float radicalInverse(int i, int base)
+    {
+      float result = 0.f, digit = 1.f/base;
+      for (; i > 0; i /= base, digit /= base)
+        result += (i % base) * digit;
+      return result;
+    }
+
+    float PKDSplatter::renderFrame(FrameBuffer *fb, const uint32 channelFlags)
+    {
+      vec2f jitter(.5f);
+      float frameLODErrorScale = lodErrorScale;
+      if (progressive) {
+        if (cameraChanged() || clearPending)
+          frameID = 0;
+        clearPending = false;
+        // coarse LOD frames are only previews: each replaces the
+        // previous one, and the first full-LOD frame starts the
+        // accumulation afresh
+        if (frameID <= progressiveLODLevels)
+          fb->clear(OSP_FB_ACCUM);
+        // the first frame looks through the pixel centers, the later
+        // ones through a Halton (2,3) pattern
+        if (frameID > 0)
+          jitter = vec2f(radicalInverse(frameID,2),radicalInverse(frameID,3));
+        // coarse-to-fine LOD, until it reaches the configured one
+        if (frameID < progressiveLODLevels)
+          frameLODErrorScale = std::max(lodErrorScale,
+                                        progressiveLODThreshold*lodPixelAngle/(1<<frameID));
+        frameID++;
+      }
+      ispc::PKDSplatter_setFrame(getIE(),progressive,(const ispc::vec2f&)jitter,
+                                 frameLODErrorScale);
+
+      return Renderer::renderFrame(fb,channelFlags);
+    }
+
     OSP_REGISTER_RENDERER(PKDSplatter,pkd_splatter);
   } // ::ospray::pkd
 } // ::ospray
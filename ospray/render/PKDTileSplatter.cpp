@@ -0,0 +1,441 @@
+// ======================================================================== //
+// Copyright 2009-2014 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+// ospray
+#include "ospray/render/Renderer.h"
+#include "ospray/camera/Camera.h"
+#include "ospray/fb/FrameBuffer.h"
+#include "ospray/geometry/Instance.h"
+#include "ospray/common/tasking/parallel_for.h"
+// ispc exports
+#include "PKDTileSplatter_ispc.h"
+// this module
+#include "../PKDGeometry.h"
+#include "../SplatKernel.h"
+// std
+#include <thread>
+
+namespace ospray {
+  namespace pkd {
+    using std::cout;
+    using std::endl;
+
+    //! edge length (in pixels) of the screen tiles splats get binned into
+    enum { PKD_TILE_SIZE = 32 };
+
+    //! number of nodes in the subtree rooted in 'nodeID' of a tree of 'numNodes' nodes
+    inline uint64 subtreeSize(uint64 numNodes, uint64 nodeID)
+    {
+      uint64 size = 0;
+      for (uint64 first=nodeID, width=1; first<numNodes; first=2*first+1, width*=2)
+        size += std::min(numNodes,first+width) - first;
+      return size;
+    }
+
+    /*! a forward splatting renderer: rather than casting a ray per
+        pixel through the tree (as pkd_splatter does), each frame
+        walks every pkd tree once - culling subtrees outside the view
+        frustum, and splatting subtrees below the LOD threshold as a
+        whole - and bins the projected splats into screen tiles, which
+        then get rasterized in parallel. frame cost thus scales with
+        the number of visible particles (or subtrees), not with pixels
+        times tree depth. only perspective cameras are supported */
+    struct PKDTileSplatter : public Renderer {
+      PKDTileSplatter();
+      virtual std::string toString() const { return "ospray::pkd::PKDTileSplatter"; }
+
+      Model  *model;
+      Camera *camera;
+      float splatRadius;
+      float splatWeight;
+      //! subtrees smaller than this many pixels get splatted as a whole
+      float lodThreshold;
+      //! the splat kernel, tabulated
+      SplatKernelLUT kernel;
+
+      //! a pkd geometry to splat, with its transform into world space
+      struct PKDInstance {
+        PartiKDGeometry *pkd;
+        affine3f         localToWorld;
+        //! largest scale factor of 'localToWorld', for transforming radii
+        float            scale;
+      };
+      std::vector<PKDInstance> instances;
+      std::vector<void *>      pkdIE;
+
+      //! the view, as derived from the camera at the start of a frame
+      struct View {
+        vec3f pos, dir, du, dv;
+        //! pixels per unit distance on the image plane at distance 1
+        float pixelsPerUnit, pixelsPerUnitX;
+        vec2i size;
+        int   numTilesX, numTilesY;
+        //! the four side planes of the frustum (normals point inside)
+        vec3f planeN[4];
+      } view;
+
+      /*! the splats of one walk (the serial top-level one, or a
+          subtree task), in the order they got emitted, and how many
+          of them overlap each tile. the latter becomes the walk's
+          offset into each tile's range of 'binned' splats */
+      struct WalkSplats {
+        std::vector<ispc::PKDTileSplat> splat;
+        std::vector<size_t>             tileCount;
+      };
+      //! a subtree still to be walked
+      struct SubtreeTask {
+        uint32 pkdID;
+        uint64 nodeID;
+        box3f  cell;
+        int    depth;
+      };
+
+      std::vector<vec4f> image;
+      /*! the splats of the serial top-level walk (0) and of each
+          subtree task (1..); kept across frames, so their storage gets
+          reused */
+      std::vector<WalkSplats> walks;
+      /*! all splats, sorted by tile (and, within a tile, by walk and
+          emit order); tile i's splats start at binned[tileBegin[i]] */
+      std::vector<ispc::PKDTileSplat> binned;
+      std::vector<size_t>             tileBegin;
+
+      //! add all pkd geometries in 'model', as transformed by 'localToWorld'
+      void collectPKDs(Model *model, const affine3f &localToWorld);
+
+      //! set up 'view' from the camera, for a frame buffer of the given size
+      bool setupView(const vec2i &size);
+
+      /*! walk the subtree rooted in 'nodeID' (with kd-cell 'cell'),
+          binning its splats; subtrees at 'taskDepth' get deferred to
+          'tasks' instead (-1 for walking everything) */
+      void walk(uint32 pkdID, uint64 nodeID, const box3f &cell, int depth,
+                WalkSplats &out, int taskDepth, std::vector<SubtreeTask> *tasks);
+
+      /*! project a splat of world-space 'center' and 'radius', add it
+          to 'out', and count it for all tiles it overlaps */
+      void emit(WalkSplats &out, const vec3f &center, float radius, float value,
+                uint32 pkdID, uint64 nodeID, bool useAggregate);
+
+      //! the tiles [tx0,tx1]x[ty0,ty1] a projected splat overlaps
+      void tileRange(const ispc::PKDTileSplat &splat,
+                     int &tx0, int &ty0, int &tx1, int &ty1) const;
+
+      //! empty walk 'walkID' (allocating it if needed), for 'numTiles' tiles
+      void clearWalk(size_t walkID, size_t numTiles);
+
+      /*! sort the splats of the first 'numWalks' walks into 'binned':
+          a prefix sum over the per-walk tile counts gives each walk
+          its own range in every tile, which the walks then fill in
+          parallel */
+      void binSplats(size_t numWalks, size_t numTiles);
+
+      virtual void commit();
+      virtual float renderFrame(FrameBuffer *fb, const uint32 channelFlags);
+    };
+
+    PKDTileSplatter::PKDTileSplatter()
+      : model(NULL), camera(NULL)
+    {
+      ispcEquivalent = ispc::PKDTileSplatter_create(this);
+    }
+
+    void PKDTileSplatter::collectPKDs(Model *model, const affine3f &localToWorld)
+    {
+      for (size_t i=0;i<model->geometry.size();i++) {
+        Geometry *geom = model->geometry[i].ptr;
+        if (Instance *instance = dynamic_cast<Instance *>(geom)) {
+          collectPKDs(instance->instancedScene.ptr,localToWorld*instance->xfm);
+          continue;
+        }
+        PartiKDGeometry *pkd = dynamic_cast<PartiKDGeometry *>(geom);
+        if (!pkd)
+          continue;
+        PKDInstance inst;
+        inst.pkd          = pkd;
+        inst.localToWorld = localToWorld;
+        inst.scale        = std::max(length(localToWorld.l.vx),
+                                     std::max(length(localToWorld.l.vy),
+                                              length(localToWorld.l.vz)));
+        instances.push_back(inst);
+        pkdIE.push_back(pkd->getIE());
+      }
+    }
+
+    void PKDTileSplatter::commit()
+    {
+      Renderer::commit();
+
+      model  = (Model *)getParamObject("world",NULL);
+      model  = (Model *)getParamObject("model",model);
+      camera = (Camera *)getParamObject("camera",NULL);
+      splatWeight  = getParamf("weight",.0001f);
+      splatRadius  = getParamf("radius",1.f);
+      lodThreshold = getParamf("lodThreshold",1.f);
+      kernel.build(parseSplatKernel(getParamString("kernel","linear")));
+
+      instances.clear();
+      pkdIE.clear();
+      if (model)
+        collectPKDs(model,affine3f(ospcommon::one));
+      if (model && instances.empty())
+        cout << "#osp:pkd: warning - no pkd geometries to splat" << endl;
+
+      ispc::PKDTileSplatter_set(getIE(),
+                                model?model->getIE():NULL,
+                                camera?camera->getIE():NULL,
+                                pkdIE.empty()?NULL:&pkdIE[0],
+                                kernel.value);
+    }
+
+    bool PKDTileSplatter::setupView(const vec2i &size)
+    {
+      if (!camera)
+        return false;
+      view.pos = camera->getParam3f("pos",vec3f(0.f));
+      view.dir = normalize(camera->getParam3f("dir",vec3f(0.f,0.f,1.f)));
+      const vec3f up   = camera->getParam3f("up",vec3f(0.f,1.f,0.f));
+      const float fovy = camera->getParamf("fovy",60.f);
+      const float aspect = camera->getParamf("aspect",float(size.x)/size.y);
+
+      // same image plane as the perspective camera
+      const float imgPlaneHeight = 2.f*tanf(deg2rad(.5f*fovy));
+      const float imgPlaneWidth  = imgPlaneHeight*aspect;
+      view.du = normalize(cross(view.dir,up));
+      view.dv = cross(view.du,view.dir);
+      view.pixelsPerUnit  = size.y / imgPlaneHeight;
+      view.pixelsPerUnitX = size.x / imgPlaneWidth;
+      view.size = size;
+      view.numTilesX = (size.x+PKD_TILE_SIZE-1)/PKD_TILE_SIZE;
+      view.numTilesY = (size.y+PKD_TILE_SIZE-1)/PKD_TILE_SIZE;
+
+      // side planes through the image plane's edges at distance 1
+      const vec3f du = .5f*imgPlaneWidth *view.du;
+      const vec3f dv = .5f*imgPlaneHeight*view.dv;
+      view.planeN[0] = normalize(cross(view.dir-du,view.dv));
+      view.planeN[1] = normalize(cross(view.dv,view.dir+du));
+      view.planeN[2] = normalize(cross(view.du,view.dir-dv));
+      view.planeN[3] = normalize(cross(view.dir+dv,view.du));
+      return true;
+    }
+
+    void PKDTileSplatter::tileRange(const ispc::PKDTileSplat &splat,
+                                    int &tx0, int &ty0, int &tx1, int &ty1) const
+    {
+      tx0 = std::max(0,int(floorf((splat.x-splat.radius)/PKD_TILE_SIZE)));
+      ty0 = std::max(0,int(floorf((splat.y-splat.radius)/PKD_TILE_SIZE)));
+      tx1 = std::min(view.numTilesX-1,int(floorf((splat.x+splat.radius)/PKD_TILE_SIZE)));
+      ty1 = std::min(view.numTilesY-1,int(floorf((splat.y+splat.radius)/PKD_TILE_SIZE)));
+    }
+
+    void PKDTileSplatter::emit(WalkSplats &out, const vec3f &center, float radius,
+                               float value, uint32 pkdID, uint64 nodeID, bool useAggregate)
+    {
+      const vec3f v = center - view.pos;
+      const float z = dot(v,view.dir);
+      if (z <= radius)
+        return;
+
+      ispc::PKDTileSplat splat;
+      splat.x      = (dot(v,view.du)/z) * view.pixelsPerUnitX + .5f*view.size.x;
+      splat.y      = (dot(v,view.dv)/z) * view.pixelsPerUnit + .5f*view.size.y;
+      splat.radius = radius/z * view.pixelsPerUnit;
+      splat.value  = value;
+      // splats that would fall between the pixel centers keep their
+      // energy, spread over a slightly larger footprint
+      const float minRadius = .75f;
+      if (splat.radius < minRadius) {
+        splat.value  *= (splat.radius*splat.radius)/(minRadius*minRadius);
+        splat.radius  = minRadius;
+      }
+      splat.nodeID       = nodeID;
+      splat.pkdID        = pkdID;
+      splat.useAggregate = useAggregate;
+
+      int tx0, ty0, tx1, ty1;
+      tileRange(splat,tx0,ty0,tx1,ty1);
+      if (tx0 > tx1 || ty0 > ty1)
+        return;
+      for (int ty=ty0;ty<=ty1;ty++)
+        for (int tx=tx0;tx<=tx1;tx++)
+          out.tileCount[ty*view.numTilesX+tx]++;
+      out.splat.push_back(splat);
+    }
+
+    void PKDTileSplatter::walk(uint32 pkdID, uint64 nodeID, const box3f &cell, int depth,
+                               WalkSplats &out, int taskDepth, std::vector<SubtreeTask> *tasks)
+    {
+      const PKDInstance &inst = instances[pkdID];
+      const PartiKDGeometry *pkd = inst.pkd;
+      // the tree the geometry traverses: the compacted one, if any
+      const bool compacted = !pkd->compacted.particle.empty();
+      const size_t numParticles = compacted ? pkd->compacted.particle.size() : pkd->numParticles;
+      const size_t numInnerNodes = numParticles/2;
+      if (nodeID >= numParticles)
+        return;
+
+      if (depth == taskDepth) {
+        SubtreeTask task = { pkdID, nodeID, cell, depth };
+        tasks->push_back(task);
+        return;
+      }
+
+      // subtrees without any visible category
+      const std::vector<uint32> &categoryMask
+        = compacted ? pkd->compacted.categoryMask : pkd->categoryMask;
+      if (nodeID < categoryMask.size()
+          && (categoryMask[nodeID] & pkd->visibleCategoryBits) == 0)
+        return;
+
+      // frustum culling on the cell's bounding sphere
+      const float radius = splatRadius*inst.scale;
+      const vec3f center = xfmPoint(inst.localToWorld,cell.center());
+      const float cellRadius = .5f*length(cell.size())*inst.scale + radius;
+      const vec3f v = center - view.pos;
+      for (int i=0;i<4;i++)
+        if (dot(v,view.planeN[i]) < -cellRadius)
+          return;
+      const float z = dot(v,view.dir);
+      if (z < -cellRadius)
+        return;
+
+      // LOD: splat subtrees that project to less than 'lodThreshold'
+      // pixels as a whole, with the energy of all their particles
+      if (nodeID < numInnerNodes && z > cellRadius
+          && 2.f*cellRadius/z*view.pixelsPerUnit < lodThreshold) {
+        const bool hasAggregate = !compacted && nodeID < pkd->numAggregates;
+        const uint64 numInSubtree = hasAggregate
+          ? pkd->aggregate[nodeID].numParticles
+          : subtreeSize(numParticles,nodeID);
+        const vec3f proxyCenter = hasAggregate
+          ? xfmPoint(inst.localToWorld,pkd->aggregate[nodeID].centroid)
+          : center;
+        const bool colorByAggregate
+          = hasAggregate && pkd->attribute && pkd->transferFunction
+          && !pkd->color && !pkd->categoryColorData;
+        emit(out,proxyCenter,cellRadius,
+             numInSubtree*splatWeight*(radius*radius)/(cellRadius*cellRadius),
+             pkdID,nodeID,colorByAggregate);
+        return;
+      }
+
+      const vec3f p = compacted ? pkd->compacted.particle[nodeID] : pkd->getParticle(nodeID);
+      emit(out,xfmPoint(inst.localToWorld,p),radius,splatWeight,pkdID,nodeID,false);
+      if (nodeID >= numInnerNodes)
+        return;
+
+      const int dim = pkd->dimFromDepth
+        ? (depth % 3)
+        : (compacted ? int(((const uint32&)p.x) & 3) : pkd->getSplitDim(nodeID));
+      box3f lCell = cell; lCell.upper[dim] = p[dim];
+      box3f rCell = cell; rCell.lower[dim] = p[dim];
+      walk(pkdID,2*nodeID+1,lCell,depth+1,out,taskDepth,tasks);
+      walk(pkdID,2*nodeID+2,rCell,depth+1,out,taskDepth,tasks);
+    }
+
+    void PKDTileSplatter::clearWalk(size_t walkID, size_t numTiles)
+    {
+      if (walkID >= walks.size())
+        walks.resize(walkID+1);
+      walks[walkID].splat.clear();
+      walks[walkID].tileCount.assign(numTiles,0);
+    }
+
+    void PKDTileSplatter::binSplats(size_t numWalks, size_t numTiles)
+    {
+      // exclusive prefix sum in (tile, walk) order; turns each walk's
+      // counts into its offsets
+      tileBegin.resize(numTiles+1);
+      size_t numBinned = 0;
+      for (size_t t=0;t<numTiles;t++) {
+        tileBegin[t] = numBinned;
+        for (size_t w=0;w<numWalks;w++) {
+          const size_t count = walks[w].tileCount[t];
+          walks[w].tileCount[t] = numBinned;
+          numBinned += count;
+        }
+      }
+      tileBegin[numTiles] = numBinned;
+
+      binned.resize(numBinned);
+      parallel_for(int(numWalks),[&](int w) {
+          std::vector<size_t> &offset = walks[w].tileCount;
+          const std::vector<ispc::PKDTileSplat> &splats = walks[w].splat;
+          for (size_t i=0;i<splats.size();i++) {
+            int tx0, ty0, tx1, ty1;
+            tileRange(splats[i],tx0,ty0,tx1,ty1);
+            for (int ty=ty0;ty<=ty1;ty++)
+              for (int tx=tx0;tx<=tx1;tx++)
+                binned[offset[ty*view.numTilesX+tx]++] = splats[i];
+          }
+        });
+    }
+
+    float PKDTileSplatter::renderFrame(FrameBuffer *fb, const uint32 channelFlags)
+    {
+      if (!setupView(fb->size)) {
+        ispc::PKDTileSplatter_setFrame(getIE(),NULL,0,0);
+        return Renderer::renderFrame(fb,channelFlags);
+      }
+
+      const size_t numThreads = std::max(1u,std::thread::hardware_concurrency());
+      const size_t numTiles = size_t(view.numTilesX)*view.numTilesY;
+
+      // walk the top of all trees serially, down to a depth that
+      // gives every thread a few subtrees ...
+      int taskDepth = 0;
+      while ((size_t(1)<<taskDepth) < 4*numThreads) taskDepth++;
+      std::vector<SubtreeTask> tasks;
+      clearWalk(0,numTiles);
+      for (uint32 i=0;i<instances.size();i++)
+        walk(i,0,instances[i].pkd->centerBounds,0,walks[0],taskDepth,&tasks);
+
+      // ... then walk those subtrees in parallel ...
+      for (size_t i=0;i<tasks.size();i++)
+        clearWalk(i+1,numTiles);
+      parallel_for(int(tasks.size()),[&](int i) {
+          walk(tasks[i].pkdID,tasks[i].nodeID,tasks[i].cell,tasks[i].depth,
+               walks[i+1],-1,NULL);
+        });
+
+      // ... sort all their splats by tile ...
+      binSplats(tasks.size()+1,numTiles);
+
+      // ... and rasterize the tiles in parallel, too
+      image.resize(size_t(view.size.x)*view.size.y);
+      ispc::PKDTileSplatter_setFrame(getIE(),(ispc::vec4f*)&image[0],
+                                     view.size.x,view.size.y);
+      parallel_for(int(numTiles),[&](int tileID) {
+          const int x0 = (tileID % view.numTilesX)*PKD_TILE_SIZE;
+          const int y0 = (tileID / view.numTilesX)*PKD_TILE_SIZE;
+          const int x1 = std::min(x0+int(PKD_TILE_SIZE),view.size.x);
+          const int y1 = std::min(y0+int(PKD_TILE_SIZE),view.size.y);
+          for (int y=y0;y<y1;y++)
+            for (int x=x0;x<x1;x++)
+              image[size_t(y)*view.size.x+x] = vec4f(0.f);
+          const size_t begin = tileBegin[tileID];
+          const size_t end   = tileBegin[tileID+1];
+          if (begin < end)
+            ispc::PKDTileSplatter_rasterize(getIE(),&binned[begin],end-begin,
+                                            x0,y0,x1,y1);
+        });
+
+      return Renderer::renderFrame(fb,channelFlags);
+    }
+
+    OSP_REGISTER_RENDERER(PKDTileSplatter,pkd_tile_splatter);
+  } // ::ospray::pkd
+} // ::ospray
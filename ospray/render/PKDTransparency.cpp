@@ -0,0 +1,116 @@
+// ======================================================================== //
+// Copyright 2009-2014 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+// ospray
+#include "ospray/render/Renderer.h"
+#include "ospray/camera/Camera.h"
+#include "ospray/geometry/Instance.h"
+// ispc exports
+#include "PKDTransparency_ispc.h"
+// this module
+#include "../PKDGeometry.h"
+
+namespace ospray {
+  namespace pkd {
+
+    /*! renders semi-transparent particles: per pixel, the closest hits
+        of all pkd geometries get gathered with one multi-hit traversal
+        per geometry (see PartiKDGeometry_intersectMulti), shaded, and
+        composited front to back */
+    struct PKDTransparency : public Renderer {
+      PKDTransparency();
+      virtual std::string toString() const { return "ospray::pkd::PKDTransparency"; }
+
+      Model  *model;
+      Camera *camera;
+
+      /*! all pkd geometries in the model (including those in
+          instanced models), with their world-to-local transforms and
+          world-space bounds */
+      std::vector<void *>   pkdIE;
+      std::vector<affine3f> worldToLocal;
+      std::vector<box3f>    worldBounds;
+
+      //! add all pkd geometries in 'model', as transformed by 'localToWorld'
+      void collectPKDs(Model *model, const affine3f &localToWorld);
+
+      virtual void commit();
+    };
+
+    PKDTransparency::PKDTransparency()
+      : model(NULL), camera(NULL)
+    {
+      ispcEquivalent = ispc::PKDTransparency_create(this);
+    }
+
+    void PKDTransparency::collectPKDs(Model *model, const affine3f &localToWorld)
+    {
+      for (size_t i=0;i<model->geometry.size();i++) {
+        Geometry *geom = model->geometry[i].ptr;
+        if (Instance *instance = dynamic_cast<Instance *>(geom)) {
+          collectPKDs(instance->instancedScene.ptr,localToWorld*instance->xfm);
+          continue;
+        }
+        PartiKDGeometry *pkd = dynamic_cast<PartiKDGeometry *>(geom);
+        if (!pkd)
+          continue;
+
+        // world-space bounds of the (transformed) particle bounds
+        const box3f local(pkd->centerBounds.lower - vec3f(pkd->particleRadius),
+                          pkd->centerBounds.upper + vec3f(pkd->particleRadius));
+        box3f world = ospcommon::empty;
+        for (int c=0;c<8;c++)
+          world.extend(xfmPoint(localToWorld,
+                                vec3f(c&1 ? local.upper.x : local.lower.x,
+                                      c&2 ? local.upper.y : local.lower.y,
+                                      c&4 ? local.upper.z : local.lower.z)));
+        pkdIE.push_back(pkd->getIE());
+        worldToLocal.push_back(rcp(localToWorld));
+        worldBounds.push_back(world);
+      }
+    }
+
+    void PKDTransparency::commit()
+    {
+      Renderer::commit();
+
+      model  = (Model *)getParamObject("world",NULL);
+      model  = (Model *)getParamObject("model",model);
+      camera = (Camera *)getParamObject("camera",NULL);
+
+      pkdIE.clear();
+      worldToLocal.clear();
+      worldBounds.clear();
+      if (model)
+        collectPKDs(model,affine3f(ospcommon::one));
+      if (model && pkdIE.empty())
+        std::cout << "#osp:pkd: warning - no pkd geometries to render" << std::endl;
+
+      ispc::PKDTransparency_set(getIE(),
+                                model?model->getIE():NULL,
+                                camera?camera->getIE():NULL,
+                                pkdIE.empty()?NULL:&pkdIE[0],
+                                worldToLocal.empty()?NULL:(ispc::AffineSpace3f*)&worldToLocal[0],
+                                worldBounds.empty()?NULL:(ispc::box3f*)&worldBounds[0],
+                                pkdIE.size(),
+                                getParam1i("maxHits",8),
+                                getParamf("opacityCutoff",.99f),
+                                getParamf("opacity",.5f));
+    }
+
+    OSP_REGISTER_RENDERER(PKDTransparency,pkd_transparency);
+  } // ::ospray::pkd
+} // ::ospray
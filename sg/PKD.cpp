@@ -38,11 +38,31 @@ namespace ospray {
     PKDGeometry::PKDGeometry() 
       : Geometry("pkd_geometry"), 
         useOldAlphaSpheresCode(false),
+        lod(false),
+        lodThreshold(1.f),
+        dimFromDepth(false),
+        prefetch(1),
         radius(0.f),
         transferFunction(NULL),
         numParticles(0),
         particle3f(NULL),
         ospPositionData(NULL),
+        color(NULL),
+        ospColorData(NULL),
+        category(NULL),
+        categoryBytes(1),
+        categoryColor(NULL),
+        numCategoryColors(0),
+        ospCategoryData(NULL),
+        particleRadius(NULL),
+        categoryRadius(NULL),
+        numCategoryRadii(0),
+        ospRadiusData(NULL),
+        aggregate(NULL),
+        numAggregates(0),
+        ospAggregateData(NULL),
+        permutation(NULL),
+        ospPermutationData(NULL),
         ospGeometry(NULL)
     {};
 
@@ -58,8 +78,16 @@ namespace ospray {
       box3f bounds = ospcommon::EmptyTy();
       for (size_t i=0;i<numParticles;i++)
         bounds.extend(getParticle(i));
-      bounds.lower -= vec3f(radius);
-      bounds.upper += vec3f(radius);
+      float maxRadius = radius;
+      if (particleRadius) {
+        for (size_t i=0;i<numParticles;i++)
+          maxRadius = std::max(maxRadius,particleRadius[i]);
+      } else if (categoryRadius) {
+        for (size_t i=0;i<numCategoryRadii;i++)
+          maxRadius = std::max(maxRadius,categoryRadius[i]);
+      }
+      bounds.lower -= vec3f(maxRadius);
+      bounds.upper += vec3f(maxRadius);
       return bounds;
     }
 
@@ -162,11 +190,65 @@ namespace ospray {
         }
       }
 
-      // set the particle radius - right now we have a fixed radius for all particles
-      if (radius == 0)
+      // assign the per-particle colors, if available
+      if (color && !ospColorData) {
+        ospColorData = ospNewData(numParticles,OSP_UCHAR4,color,OSP_DATA_SHARED_BUFFER);
+        ospSetData(ospGeometry,"color",ospColorData);
+        cout << "#osp:pkd: numbytes for particle colors: " << numParticles*sizeof(uint32_t) << endl;
+      }
+
+      // assign the categorical channel, with palette and visibility
+      if (category && !ospCategoryData) {
+        ospCategoryData = ospNewData(numParticles*categoryBytes,OSP_UCHAR,category,
+                                     OSP_DATA_SHARED_BUFFER);
+        ospSetData(ospGeometry,"category",ospCategoryData);
+        if (categoryColor) {
+          OSPData palette = ospNewData(numCategoryColors,OSP_FLOAT3,categoryColor,
+                                       OSP_DATA_SHARED_BUFFER);
+          ospSetData(ospGeometry,"categoryColor",palette);
+        }
+        if (!categoryVisible.empty()) {
+          OSPData visible = ospNewData(categoryVisible.size(),OSP_UCHAR,&categoryVisible[0]);
+          ospSetData(ospGeometry,"categoryVisible",visible);
+        }
+      }
+
+      // assign per-particle or per-category radii, if any
+      if ((particleRadius || categoryRadius) && !ospRadiusData) {
+        if (particleRadius) {
+          ospRadiusData = ospNewData(numParticles,OSP_FLOAT,particleRadius,
+                                     OSP_DATA_SHARED_BUFFER);
+          ospSetData(ospGeometry,"particleRadius",ospRadiusData);
+        } else {
+          ospRadiusData = ospNewData(numCategoryRadii,OSP_FLOAT,categoryRadius,
+                                     OSP_DATA_SHARED_BUFFER);
+          ospSetData(ospGeometry,"categoryRadius",ospRadiusData);
+        }
+      }
+
+      // assign the subtree aggregates, if the builder wrote any
+      if (aggregate && !ospAggregateData) {
+        ospAggregateData = ospNewData(numAggregates*sizeof(PKDAggregate),OSP_UCHAR,aggregate,
+                                      OSP_DATA_SHARED_BUFFER);
+        ospSetData(ospGeometry,"aggregate",ospAggregateData);
+        cout << "#osp:pkd: numbytes for subtree aggregates: " << numAggregates*sizeof(PKDAggregate) << endl;
+      }
+
+      if (permutation && !ospPermutationData) {
+        ospPermutationData = ospNewData(numParticles,OSP_ULONG,permutation,
+                                        OSP_DATA_SHARED_BUFFER);
+        ospSetData(ospGeometry,"permutation",ospPermutationData);
+      }
+
+      ospSet1i(ospGeometry,"dimFromDepth",dimFromDepth);
+      ospSet1i(ospGeometry,"prefetch",prefetch);
+      ospSet1i(ospGeometry,"lod",lod);
+      ospSet1f(ospGeometry,"lodThreshold",lodThreshold);
+
+      // set the (default) particle radius
+      if (radius == 0 && !particleRadius)
         std::cout << "#osp:sg:pkd: warning - radius is 0" << std::endl;
-      else {
-        assert(radius > 0.f);
+      else if (radius > 0.f) {
         ospSet1f(ospGeometry,"radius",radius);
       }
       ospCommit(ospGeometry);
@@ -223,6 +305,83 @@ namespace ospray {
           continue;
         } 
       
+        if (child->name == "aggregate") {
+          if (child->getProp("format") != "pkdAggregate2") {
+            std::cout << "#osp:sg:PKDGeometry: Warning - ignoring subtree aggregates of an older format"
+                      << " (re-run ospPartiKD to get them back)" << std::endl;
+            continue;
+          }
+          numAggregates = child->getPropl("count");
+          aggregate = (PKDAggregate *)(binBasePtr+child->getPropl("ofs"));
+          std::cout << "#osp:sg:PKDGeometry: found " << numAggregates << " subtree aggregates" << std::endl;
+          continue;
+        } 
+
+        if (child->name == "color") {
+          color = (uint32_t *)(binBasePtr+child->getPropl("ofs"));
+          std::cout << "#osp:sg:PKDGeometry: found per-particle RGBA8 colors" << std::endl;
+          continue;
+        } 
+
+        if (child->name == "category") {
+          category = (uint8_t *)(binBasePtr+child->getPropl("ofs"));
+          categoryBytes = (child->getProp("format") == "uint16") ? 2 : 1;
+          std::cout << "#osp:sg:PKDGeometry: found per-particle categories" << std::endl;
+          continue;
+        } 
+
+        if (child->name == "permutation") {
+          permutation = (uint64_t *)(binBasePtr+child->getPropl("ofs"));
+          continue;
+        } 
+
+        if (child->name == "particleRadius") {
+          particleRadius = (float *)(binBasePtr+child->getPropl("ofs"));
+          std::cout << "#osp:sg:PKDGeometry: found per-particle radii" << std::endl;
+          continue;
+        } 
+
+        if (child->name == "categoryRadius") {
+          categoryRadius = (float *)(binBasePtr+child->getPropl("ofs"));
+          numCategoryRadii = child->getPropl("count");
+          std::cout << "#osp:sg:PKDGeometry: found per-category radii" << std::endl;
+          continue;
+        } 
+
+        if (child->name == "categoryColor") {
+          categoryColor = (vec3f *)(binBasePtr+child->getPropl("ofs"));
+          numCategoryColors = child->getPropl("count");
+          continue;
+        } 
+
+        if (child->name == "hideCategory") {
+          const size_t c = child->getPropl("value");
+          if (categoryVisible.size() <= c)
+            categoryVisible.resize(c+1,1);
+          categoryVisible[c] = 0;
+          std::cout << "#osp:sg:PKDGeometry: hiding category " << c << std::endl;
+          continue;
+        } 
+
+        if (child->name == "dimFromDepth") {
+          dimFromDepth = child->getPropl("value");
+          continue;
+        } 
+
+        if (child->name == "prefetch") {
+          prefetch = child->getPropl("value");
+          std::cout << "#osp:sg:PKDGeometry: traversal prefetch mode " << prefetch << std::endl;
+          continue;
+        } 
+
+        if (child->name == "lod") {
+          lod = child->getPropl("value");
+          std::string threshold = child->getProp("threshold");
+          if (!threshold.empty())
+            lodThreshold = atof(threshold.c_str());
+          continue;
+        } 
+      
         if (child->name == "radius") {
           radius = atof(child->content.c_str());
           std::cout << "#osp:sg:PKDGeometry: found radius " << radius << std::endl;
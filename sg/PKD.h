@@ -17,6 +17,8 @@
 #pragma once
 
 #include "sg/geometry/Spheres.h"
+// this module
+#include "../ospray/PKDAggregate.h"
 
 namespace ospray {
   namespace sg {
@@ -91,6 +93,41 @@ namespace ospray {
       /*! list of attributes; each attribute must have numParticles values */
       std::vector<Attribute *> attribute;
 
+      /*! optional per-particle RGBA8 colors (r in the lowest byte),
+          and the ospray data array for them */
+      uint32_t *color;
+      OSPData   ospColorData;
+
+      /*! optional categorical channel (one uint8 or uint16 per
+          particle, 'categoryBytes' each), its color palette, and the
+          per-category visibility; categories get hidden by
+          "<hideCategory value='3'/>" statements in the xml node */
+      uint8_t              *category;
+      int                   categoryBytes;
+      vec3f                *categoryColor;
+      size_t                numCategoryColors;
+      std::vector<uint8_t>  categoryVisible;
+      OSPData               ospCategoryData;
+
+      /*! optional radii that override 'radius': one float per
+          particle, or one per category (0 meaning 'radius') */
+      float   *particleRadius;
+      float   *categoryRadius;
+      size_t   numCategoryRadii;
+      OSPData  ospRadiusData;
+
+      /*! subtree aggregates for the top levels of the tree (if
+          written by the builder), and the ospray data array for them */
+      PKDAggregate *aggregate;
+      size_t        numAggregates;
+      OSPData       ospAggregateData;
+
+      /*! input index of each particle (if the builder wrote it), so
+          applications can pass attributes of later timesteps in input
+          order as 'inputAttribute' */
+      uint64_t *permutation;
+      OSPData   ospPermutationData;
+
       /*! single radius applied to all spheres in this geometry */
       float radius;
       
@@ -109,6 +146,23 @@ namespace ospray {
           statement to the xml node we can enable the old code for
           comparison purposes */
       bool useOldAlphaSpheresCode;
+
+      /*! if enabled, the geometry uses level-of-detail traversal,
+          replacing subtrees that project to less than 'lodThreshold'
+          pixels by a single proxy sphere; enabled by adding a
+          "<lod value='1' threshold='2'/>" statement to the xml node */
+      bool  lod;
+      float lodThreshold;
+
+      /*! whether the tree was built with round-robin split dims (so
+          the traversal can derive the dim from the depth) */
+      bool dimFromDepth;
+
+      /*! software prefetching mode of the traversal (0: off, 1:
+          children, 2: also grandchildren in the lower tree levels);
+          set by a "<prefetch value='0'/>" statement in the xml node,
+          for benchmarking */
+      int prefetch;
     // public:
     //   static sg::World *importPKDFile(const std::string &fileName);
     };